@@ -3,15 +3,47 @@
 asflags="-Wall -felf64 -gdwarf"
 as=nasm
 
-ccflags="-static -Wall -Wextra -gdwarf -Isrc/ -mcmodel=large"
+ccflags="-static -Wall -Wextra -gdwarf -Isrc/ -mcmodel=large -fno-omit-frame-pointer"
 cc=clang
 
+# C++ links against the same objects, but keeps the default code model, which
+# static libstdc++ expects.
+cxxflags="-std=c++20 -static -Wall -Wextra -gdwarf -Isrc/ -fno-omit-frame-pointer"
+cxx=clang++
+
+# Scheduling policies to build benchmarks for (see `TASK_SCHED_POLICY`).
+policies="ROUND_ROBIN LIFO FIFO"
+
 if [ "$1" == "clean" ]
 then
     rm *.o
     rm *.out
+elif [ "$1" == "bench" ]
+then
+    $as $asflags src/task_asm.nasm -o task_asm.o || exit 1
+
+    for policy in $policies
+    do
+	for arena in 0 1
+	do
+	    bflags="-O2 -DTASK_SCHED_POLICY=TASK_SCHED_$policy -DTASK_ARENA=$arena"
+
+	    $cc $ccflags $bflags -c src/task.c -o task_bench.o &&
+		$cc $ccflags $bflags src/bench.c task_bench.o task_asm.o \
+		    -lpthread -o task_bench.out &&
+		./task_bench.out || exit 1
+	done
+    done
 else
     $cc $ccflags -c src/task.c -o task.o &&
+	$cc $ccflags -c src/task_prof.c -o task_prof.o &&
+	$cc $ccflags -c src/task_log.c -o task_log.o &&
+	$cc $ccflags -c src/task_watchdog.c -o task_watchdog.o &&
 	$as $asflags src/task_asm.nasm -o task_asm.o &&
-	$cc $ccflags src/main.c task.o task_asm.o -o task_demo.out
+	$cc $ccflags src/main.c task.o task_prof.o task_log.o task_watchdog.o \
+	    task_asm.o -lpthread -lrt -o task_demo.out &&
+	$cc $ccflags src/loadgen.c task.o task_asm.o -lm -lpthread \
+	    -o task_loadgen.out &&
+	$cxx $cxxflags src/example.cpp task.o task_asm.o -lpthread \
+	    -o task_example.out
 fi
@@ -0,0 +1,300 @@
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "task.h"
+
+#define RING_TASKS  32
+#define RING_ROUNDS 100000
+
+#define SPAWN_TOTAL  100000
+#define SPAWN_BATCH  16
+#define SPAWN_YIELDS 4
+
+#define COMPUTE_TASKS 4
+#define COMPUTE_ITERS 2000000
+
+#if   TASK_SCHED_POLICY == TASK_SCHED_ROUND_ROBIN
+#  define POLICY_NAME "round-robin"
+#elif TASK_SCHED_POLICY == TASK_SCHED_LIFO
+#  define POLICY_NAME "lifo"
+#elif TASK_SCHED_POLICY == TASK_SCHED_FIFO
+#  define POLICY_NAME "fifo"
+#endif
+
+#if TASK_ARENA
+#  define ARENA_NAME "huge-page arena"
+#else
+#  define ARENA_NAME "malloc"
+#endif
+
+
+
+static u64
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+}
+
+/******************************************************************************
+ * dTLB miss counting, where perf events are available.                       *
+ ******************************************************************************/
+
+static int tlb_fd = -1;
+
+static void
+tlb_open (void)
+{
+	struct perf_event_attr attr = { 0 };
+
+	attr.type           = PERF_TYPE_HW_CACHE;
+	attr.size           = sizeof (attr);
+	attr.config         = PERF_COUNT_HW_CACHE_DTLB
+			    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+
+	tlb_fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+tlb_start (void)
+{
+	if (tlb_fd == -1)
+		return;
+
+	ioctl (tlb_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl (tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Returns the misses since `tlb_start`, or -1 without a counter.
+static i64
+tlb_stop (void)
+{
+	u64 misses;
+
+	if (tlb_fd == -1)
+		return -1;
+
+	ioctl (tlb_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if (read (tlb_fd, &misses, sizeof (misses)) != sizeof (misses))
+		return -1;
+
+	return (i64) misses;
+}
+
+static void
+report (const char *name, u64 switches, u64 ns, i64 tlb_misses)
+{
+	printf ("%-6s: %10llu switches, %7.2f ns/switch",
+		name,
+		(unsigned long long) switches,
+		(double) ns / (double) switches);
+
+	if (tlb_misses >= 0)
+		printf (", %6.3f dTLB misses/switch",
+			(double) tlb_misses / (double) switches);
+
+	putchar ('\n');
+}
+
+
+
+/******************************************************************************
+ * Ring rotation -- a fixed set of tasks yielding to each other.              *
+ ******************************************************************************/
+
+static int ring_live = 0;
+
+void
+ring_task (void)
+{
+	for (int i = 0; i < RING_ROUNDS; i++)
+		task_yield();
+
+	ring_live--;
+	task_terminate();
+}
+
+static void
+bench_ring (void)
+{
+	for (int i = 0; i < RING_TASKS; i++)
+	{
+		if (!task_create (ring_task))
+		{
+			fputs ("Failed to create ring_task!\n", stderr);
+			break;
+		}
+
+		ring_live++;
+	}
+
+	u64 switches = 0;
+	u64 start    = now_ns();
+
+	tlb_start();
+
+	while (ring_live > 0)
+	{
+		task_yield();
+		switches++;
+	}
+
+	i64 misses = tlb_stop();
+	u64 ns     = now_ns() - start;
+
+	// Every round of the ring is one switch per task, plus main's own.
+	switches *= RING_TASKS + 1;
+
+	report ("ring", switches, ns, misses);
+}
+
+
+
+/******************************************************************************
+ * Spawn churn -- short-lived tasks created in batches.                       *
+ ******************************************************************************/
+
+static int spawn_live  = 0;
+static u64 spawn_yield = 0;
+
+void
+spawn_task (void)
+{
+	for (int i = 0; i < SPAWN_YIELDS; i++)
+	{
+		spawn_yield++;
+		task_yield();
+	}
+
+	spawn_live--;
+	task_terminate();
+}
+
+static void
+bench_spawn (void)
+{
+	u64 switches = 0;
+	u64 start    = now_ns();
+
+	tlb_start();
+
+	for (int done = 0; done < SPAWN_TOTAL; done += SPAWN_BATCH)
+	{
+		for (int i = 0; i < SPAWN_BATCH; i++)
+		{
+			if (!task_create (spawn_task))
+			{
+				fputs ("Failed to create spawn_task!\n", stderr);
+				break;
+			}
+
+			spawn_live++;
+		}
+
+		while (spawn_live > 0)
+		{
+			task_yield();
+			switches++;
+		}
+	}
+
+	i64 misses = tlb_stop();
+	u64 ns     = now_ns() - start;
+
+	// Each spawned task also switches away once more as it terminates.
+	report ("spawn", switches + spawn_yield + SPAWN_TOTAL, ns, misses);
+}
+
+
+
+/******************************************************************************
+ * Compute loops -- tasks checking in on every iteration of some busy-work.   *
+ ******************************************************************************/
+
+static int          compute_live  = 0;
+static bool         compute_maybe = false;
+static volatile u64 compute_sink  = 0;
+
+void
+compute_task (void)
+{
+	u64 x = 1;
+
+	for (int i = 0; i < COMPUTE_ITERS; i++)
+	{
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+
+		if (compute_maybe)
+			task_maybe_yield();
+		else
+			task_yield();
+	}
+
+	compute_sink += x;
+	compute_live--;
+	task_terminate();
+}
+
+static void
+bench_compute (bool maybe)
+{
+	compute_maybe = maybe;
+
+	for (int i = 0; i < COMPUTE_TASKS; i++)
+	{
+		if (!task_create (compute_task))
+		{
+			fputs ("Failed to create compute_task!\n", stderr);
+			break;
+		}
+
+		compute_live++;
+	}
+
+	u64 start = now_ns();
+
+	while (compute_live > 0)
+		task_yield();
+
+	u64 ns = now_ns() - start;
+
+	printf ("%-6s: %10d iterations, %7.2f ns/iteration\n",
+		maybe ? "maybe" : "yield",
+		COMPUTE_TASKS * COMPUTE_ITERS,
+		(double) ns / (double) (COMPUTE_TASKS * COMPUTE_ITERS));
+}
+
+
+
+int
+main (void)
+{
+	if (!task_setup (NULL))
+	{
+		fputs ("Failed to init tasking.\n", stderr);
+		return -1;
+	}
+
+	printf ("policy: %s (%s)\n", POLICY_NAME, ARENA_NAME);
+
+	tlb_open();
+
+	bench_ring();
+	bench_spawn();
+	bench_compute (false);
+	bench_compute (true);
+
+	task_terminate();
+}
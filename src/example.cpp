@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <vector>
+
+#include "task.hpp"
+#include "task_coro.hpp"
+
+#define PARTS 4
+
+/* Sums a range in parts, one task each through `task::spawn`, then passes the
+ * part sums from one coroutine to another over a channel.
+ */
+
+static task::co::Routine
+producer (task::co::Channel<long> &ch, const std::vector<long> &sums)
+{
+	for (long sum : sums)
+		co_await ch.send (sum);
+}
+
+static task::co::Routine
+consumer (task::co::Channel<long> &ch, long &total, bool &done)
+{
+	for (int i = 0; i < PARTS; i++)
+		total += co_await ch.receive();
+
+	done = true;
+}
+
+int
+main ()
+{
+	if (!task_setup (nullptr))
+	{
+		std::fputs ("Failed to init tasking.\n", stderr);
+		return -1;
+	}
+
+	std::vector<long> values (1000);
+
+	for (std::size_t i = 0; i < values.size(); i++)
+		values[i] = i;
+
+	std::vector<long> sums (PARTS);
+
+	{
+		std::vector<task::Handle> handles;
+
+		for (std::size_t part = 0; part < PARTS; part++)
+		{
+			handles.push_back (task::spawn ([&, part]
+			{
+				std::size_t size = values.size() / PARTS;
+
+				for (std::size_t i = part * size;
+				     i < (part + 1) * size; i++)
+				{
+					sums[part] += values[i];
+					task_yield();
+				}
+			}));
+		}
+	} // Joined here.
+
+	task::co::Channel<long> ch;
+	long                    total = 0;
+	bool                    done  = false;
+
+	if (!task::co::spawn (producer (ch, sums))
+	    || !task::co::spawn (consumer (ch, total, done)))
+	{
+		std::fputs ("Failed to spawn coroutines.\n", stderr);
+		return -1;
+	}
+
+	while (!done)
+		task_yield();
+
+	for (std::size_t part = 0; part < PARTS; part++)
+		std::printf ("part %zu\t: %ld\n", part, sums[part]);
+
+	std::printf ("total\t: %ld\n", total);
+
+	task_terminate();
+}
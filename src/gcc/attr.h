@@ -198,9 +198,10 @@
 
 /** NORETURN
  *
- * Tells the compiler that the given function never returns.
+ * Tells the compiler that the given function never returns. Spelled with
+ * underscores, since `noreturn` is itself a macro in C11.
  */
-#define NORETURN CC_ATTR(noreturn)
+#define NORETURN CC_ATTR(__noreturn__)
 
 
 
@@ -129,6 +129,11 @@
  * Memory operations.                                                         *
  ******************************************************************************/
 
+/* These would clobber the C++ standard library's own declarations, so they are
+ * left to C.
+ */
+#ifndef __cplusplus
+
 #define memcpy(dest, src, num) __builtin_memcpy(dest, src, num)
 #define memcmp(s1, s2, num)    __builtin_memcmp(dest, src, num)
 #define memset(s, c, num)      __builtin_memset(dest, src, num)
@@ -178,4 +183,6 @@
 #define tolower(c) __builtin_tolower(c)
 #define toupper(c) __builtin_toupper(c)
 
+#endif /* __cplusplus */
+
 /* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,437 @@
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "task.h"
+
+#if   TASK_SCHED_POLICY == TASK_SCHED_ROUND_ROBIN
+#  define POLICY_NAME "round-robin"
+#elif TASK_SCHED_POLICY == TASK_SCHED_LIFO
+#  define POLICY_NAME "lifo"
+#elif TASK_SCHED_POLICY == TASK_SCHED_FIFO
+#  define POLICY_NAME "fifo"
+#endif
+
+// Arrivals that can wait for a worker before new ones are dropped.
+#define BACKLOG_SIZE 65536
+
+/* Open-loop load: requests arrive as a Poisson process at a fixed rate, no
+ * matter how far behind the workers are, and queue up for a pool of worker
+ * tasks. Serving one means spinning for the compute time, split up by a
+ * number of yields, and then for some share of requests making a blocking
+ * call on a helper thread, which wakes the worker with `task_inject_wake`.
+ *
+ * Scheduling latency is the time from a request's arrival until a worker
+ * starts on it; response time runs until the worker is done.
+ */
+
+static struct
+{
+	double rate;       // Requests per second.
+	double duration;   // Seconds of arrivals.
+	u32    workers;
+	u64    compute_ns; // Spinning per request.
+	u32    yields;     // Yields splitting up the spinning.
+	u32    block_pct;  // Share of requests which block, in percent.
+	u64    block_ns;   // Time each blocking call takes.
+	u32    blockers;   // Helper threads serving blocking calls.
+}
+opt =
+{
+	.rate       = 20000,
+	.duration   = 2,
+	.workers    = 32,
+	.compute_ns = 20000,
+	.yields     = 2,
+	.block_pct  = 10,
+	.block_ns   = 200000,
+	.blockers   = 4,
+};
+
+
+
+static u64
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+}
+
+static void
+spin_ns (u64 ns)
+{
+	u64 end = now_ns() + ns;
+
+	while (now_ns() < end)
+		;
+}
+
+// Per-task xorshift, so workers don't share any state for it.
+static u64
+random_next (u64 *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+/******************************************************************************
+ * Requests and results.                                                      *
+ ******************************************************************************/
+
+static u64 backlog[BACKLOG_SIZE]; // Arrival times, oldest first.
+static u32 backlog_head  = 0;
+static u32 backlog_count = 0;
+
+static u64 *sched_latency = NULL;
+static u64 *response_time = NULL;
+static u64  result_count  = 0;
+static u64  result_max    = 0;
+
+static u64 offered = 0;
+static u64 dropped = 0;
+
+static void
+record (u64 arrival, u64 start, u64 end)
+{
+	if (result_count == result_max)
+		return;
+
+	sched_latency[result_count] = start - arrival;
+	response_time[result_count] = end - arrival;
+	result_count++;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	u64 x = *(const u64 *) a;
+	u64 y = *(const u64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report (const char *name, u64 *ns, u64 count)
+{
+	if (count == 0)
+		return;
+
+	qsort (ns, count, sizeof (u64), compare_u64);
+
+	double p[] = { 0.5, 0.99, 0.999 };
+
+	printf ("%-13s:", name);
+
+	for (u32 i = 0; i < sizeof (p) / sizeof (p[0]); i++)
+	{
+		u64 at = min ((u64) (p[i] * count), count - 1);
+
+		printf (" p%g %9.1f us,", p[i] * 100, ns[at] / 1000.0);
+	}
+
+	printf (" max %9.1f us\n", ns[count - 1] / 1000.0);
+}
+
+/******************************************************************************
+ * Blocking calls -- served by helper threads.                                *
+ ******************************************************************************/
+
+typedef struct
+{
+	Task_ID tid;
+	u64     ns;
+	int     done;
+}
+Block_Call;
+
+static int block_pipe[2];
+
+static void *
+blocker (UNUSED void *arg)
+{
+	Block_Call *call;
+
+	while (read (block_pipe[0], &call, sizeof (call)) == sizeof (call))
+	{
+		struct timespec ts =
+		{
+			.tv_sec  = call -> ns / 1000000000,
+			.tv_nsec = call -> ns % 1000000000,
+		};
+
+		nanosleep (&ts, NULL);
+
+		// The call is gone as soon as the worker sees it's done.
+		Task_ID tid = call -> tid;
+
+		__atomic_store_n (&call -> done, 1, __ATOMIC_RELEASE);
+
+		while (!task_inject_wake (tid))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void
+block (Task_ID self)
+{
+	Block_Call  call = { .tid = self, .ns = opt.block_ns, .done = 0 };
+	Block_Call *ptr  = &call;
+
+	if (write (block_pipe[1], &ptr, sizeof (ptr)) != sizeof (ptr))
+		return;
+
+	while (!__atomic_load_n (&call.done, __ATOMIC_ACQUIRE))
+		task_park();
+}
+
+/******************************************************************************
+ * Workers.                                                                   *
+ ******************************************************************************/
+
+typedef struct
+{
+	Task_ID tid;
+	bool    idle;
+}
+Worker;
+
+static Worker *workers      = NULL;
+static u32    *idle         = NULL; // Indices of parked workers.
+static u32     idle_count   = 0;
+static u32     workers_live = 0;
+static bool    stopping     = false;
+
+static void
+worker (void *arg)
+{
+	Worker *w     = arg;
+	u64     state = 0x9E3779B97F4A7C15ULL * (w -> tid + 1);
+
+	for (;;)
+	{
+		if (backlog_count == 0)
+		{
+			if (stopping)
+				break;
+
+			// A stray wake may come in while already idle.
+			if (!w -> idle)
+			{
+				w -> idle = true;
+				idle[idle_count++] = w - workers;
+			}
+
+			task_park();
+			continue;
+		}
+
+		u64 arrival = backlog[backlog_head];
+
+		backlog_head = (backlog_head + 1) % BACKLOG_SIZE;
+		backlog_count--;
+
+		u64 start = now_ns();
+		u64 chunk = opt.compute_ns / (opt.yields + 1);
+
+		for (u32 i = 0; i < opt.yields; i++)
+		{
+			spin_ns (chunk);
+			task_yield();
+		}
+
+		spin_ns (chunk);
+
+		if (random_next (&state) % 100 < opt.block_pct)
+			block (w -> tid);
+
+		record (arrival, start, now_ns());
+	}
+
+	workers_live--;
+	task_terminate();
+}
+
+static void
+wake_worker (void)
+{
+	if (idle_count == 0)
+		return;
+
+	Worker *w = &workers[idle[--idle_count]];
+
+	w -> idle = false;
+	task_wake (w -> tid);
+}
+
+/******************************************************************************
+ * Arrivals.                                                                  *
+ ******************************************************************************/
+
+// Runs as the initial task, for as long as arrivals last.
+static void
+dispatch (void)
+{
+	u64 state = 0x2545F4914F6CDD1DULL;
+	u64 start = now_ns();
+	u64 end   = start + (u64) (opt.duration * 1e9);
+	u64 next  = start;
+
+	while (next < end)
+	{
+		u64 now = now_ns();
+
+		while (next <= now && next < end)
+		{
+			offered++;
+
+			if (backlog_count == BACKLOG_SIZE)
+			{
+				dropped++;
+			}
+			else
+			{
+				backlog[(backlog_head + backlog_count)
+					% BACKLOG_SIZE] = next;
+				backlog_count++;
+				wake_worker();
+			}
+
+			// Exponential gaps, from a uniform in (0, 1].
+			double u = (double) ((random_next (&state) >> 11) + 1)
+				/ (double) (1ULL << 53);
+
+			next += (u64) (-log (u) / opt.rate * 1e9);
+		}
+
+		task_yield();
+	}
+
+	stopping = true;
+
+	while (idle_count != 0)
+		wake_worker();
+
+	while (workers_live != 0)
+		task_yield();
+
+	double elapsed = (now_ns() - start) / 1e9;
+
+	printf ("offered      : %llu requests, %llu dropped\n",
+		(unsigned long long) offered, (unsigned long long) dropped);
+	printf ("completed    : %llu requests, %.1f req/s\n",
+		(unsigned long long) result_count, result_count / elapsed);
+
+	report ("sched latency", sched_latency, result_count);
+	report ("response time", response_time, result_count);
+}
+
+
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		 "Usage: %s [-r rate] [-d seconds] [-w workers]"
+		 " [-c compute_us] [-y yields]\n"
+		 "          [-b block_percent] [-B block_us] [-t threads]\n",
+		 name);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt (argc, argv, "r:d:w:c:y:b:B:t:")) != -1)
+	{
+		switch (c)
+		{
+		case 'r': opt.rate       = atof (optarg);               break;
+		case 'd': opt.duration   = atof (optarg);               break;
+		case 'w': opt.workers    = atoi (optarg);               break;
+		case 'c': opt.compute_ns = atof (optarg) * 1000;        break;
+		case 'y': opt.yields     = atoi (optarg);               break;
+		case 'b': opt.block_pct  = atoi (optarg);               break;
+		case 'B': opt.block_ns   = atof (optarg) * 1000;        break;
+		case 't': opt.blockers   = atoi (optarg);               break;
+		default:  usage (argv[0]);
+		}
+	}
+
+	if (opt.rate <= 0 || opt.duration <= 0 || opt.workers == 0
+	    || opt.workers >= MAX_u16 || opt.blockers == 0)
+		usage (argv[0]);
+
+	Task_Config config = TASK_CONFIG_DEFAULT;
+
+	config.task_count_max = max (config.task_count_max, opt.workers + 1);
+
+	if (!task_setup (&config))
+	{
+		fputs ("Failed to init tasking.\n", stderr);
+		return -1;
+	}
+
+	result_max    = (u64) (opt.rate * opt.duration * 1.1) + 1024;
+	sched_latency = malloc (result_max * sizeof (u64));
+	response_time = malloc (result_max * sizeof (u64));
+	workers       = malloc (opt.workers * sizeof (Worker));
+	idle          = malloc (opt.workers * sizeof (u32));
+
+	if (sched_latency == NULL || response_time == NULL
+	    || workers == NULL || idle == NULL || pipe (block_pipe) != 0)
+	{
+		fputs ("Failed to allocate.\n", stderr);
+		return -1;
+	}
+
+	for (u32 i = 0; i < opt.blockers; i++)
+	{
+		pthread_t thread;
+
+		if (pthread_create (&thread, NULL, blocker, NULL) != 0)
+		{
+			fputs ("Failed to create blocker thread!\n", stderr);
+			return -1;
+		}
+	}
+
+	printf ("policy       : %s, %u workers\n", POLICY_NAME, opt.workers);
+	printf ("load         : %.0f req/s for %.1f s, %.1f us compute"
+		" over %u yields, %u%% blocking %.1f us\n",
+		opt.rate, opt.duration, opt.compute_ns / 1000.0, opt.yields,
+		opt.block_pct, opt.block_ns / 1000.0);
+
+	for (u32 i = 0; i < opt.workers; i++)
+	{
+		Task *t = task_raw_create ((void (*)(void)) worker);
+
+		if (t == NULL)
+		{
+			fputs ("Failed to create worker!\n", stderr);
+			return -1;
+		}
+
+		workers[i] = (Worker) { .tid = t -> id, .idle = false };
+		t -> start_arg = (u64) &workers[i];
+		task_raw_enqueue (t);
+		workers_live++;
+	}
+
+	dispatch();
+
+	task_terminate();
+}
@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <unistd.h>
 
 #include "task.h"
+#include "task_log.h"
 
 #define MULTIPLIER 2
 
@@ -11,7 +13,7 @@ task_a (void)
 {
         for (int i = 0; i < 16 * MULTIPLIER; i++)
 	{
-		printf ("task_a\t: Hello! (Iter #%d)\n", i);
+		task_log ("task_a\t: Hello! (Iter #%d)\n", i);
 		task_yield();
 	}
 
@@ -25,7 +27,7 @@ task_b (void)
 {
 	for (int i = 0; i < 8 * MULTIPLIER; i++)
 	{
-	        printf ("task_b\t: Hello! (Iter #%d)\n", i);
+	        task_log ("task_b\t: Hello! (Iter #%d)\n", i);
 		task_yield();
 	}
 
@@ -37,13 +39,14 @@ task_b (void)
 int
 main (void)
 {
-	puts ("Starting tasking...");
-	if (!task_setup())
+	if (!task_setup (NULL) || !task_log_setup (STDOUT_FILENO))
 	{
 		fputs ("Failed to init tasking.\n", stderr);
 		return -1;
 	}
 
+	task_log ("Starting tasking...\n");
+
 	if (!task_create (task_a))
 	{
 		fputs ("Failed to create task_a!\n", stderr);
@@ -54,10 +57,10 @@ main (void)
 		fputs ("Failed to create task_b!\n", stderr);
 	}
 
-	puts ("Yielding to tasks...");
+	task_log ("Yielding to tasks...\n");
 	for (int i = 0; i < 4 * MULTIPLIER; i++)
 	{
-	        printf ("main\t: Hello! (Iter #%d)\n", i);
+	        task_log ("main\t: Hello! (Iter #%d)\n", i);
 		task_yield();
 	}
 
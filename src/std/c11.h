@@ -13,7 +13,14 @@
 /* This file is really more of a formality, currently just renaming the C11
  * identifiers with a more standard style.
  */
-#if __STDC_VERSION__ >= 201112L
+#if defined (__cplusplus)
+
+/* C++ already has `static_assert` and `alignas`/`alignof`. `noreturn` is
+ * left alone, since the standard headers spell `[[noreturn]]` themselves --
+ * headers shared with C++ use `NORETURN` from gcc/attr.h instead.
+ */
+
+#elif __STDC_VERSION__ >= 201112L
 
 #  ifndef   generic
 #    define generic _Generic
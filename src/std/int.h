@@ -10,6 +10,8 @@
  ******************************************************************************/
 #pragma once
 
+#ifndef __cplusplus
+
 #ifndef   NULL
 #  define NULL ((void *) 0)
 #endif
@@ -22,6 +24,8 @@
 #  define false 0
 #endif
 
+#endif /* __cplusplus */
+
 #include <std/c11.h>
 #include <gcc/attr.h>
 #include <gcc/builtin.h>
@@ -45,7 +49,9 @@ typedef MODE_b128 unsigned int u128;
 typedef MODE_POINTER int isize;
 typedef MODE_POINTER unsigned int usize;
 
-#if __STDC_VERSION__ >= 199901L
+#if defined (__cplusplus)
+// Built in, and the same as C's `_Bool`.
+#elif __STDC_VERSION__ >= 199901L
 typedef _Bool bool;
 #else
 typedef u8 bool;
@@ -98,6 +104,9 @@ ASSERT_SIZE (u128, 16);
  * Helper function-macros.                                                    *
  ******************************************************************************/
 
+// These share names with the C++ standard library, so are left to C.
+#ifndef __cplusplus
+
 #define max(a, b)				\
 	({					\
 		typeof (a) _a = (a);		\
@@ -171,4 +180,6 @@ ASSERT_SIZE (u128, 16);
 		1 << x;				\
 	})
 
+#endif /* __cplusplus */
+
 /* ----------------------------------- EOF ---------------------------------- */
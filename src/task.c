@@ -5,10 +5,24 @@
  *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
  *                                                                            *
  ******************************************************************************/
+#define _GNU_SOURCE
+
 #include "task.h"
 
+#include <cpuid.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 /******************************************************************************
  * Function imports.                                                          *
@@ -16,15 +30,80 @@
 
 // Defined in task_asm.s.
 extern          void task_switch (Task *old_t, Task *new_t);
-extern noreturn void task_switch_destroy (Task *old_t, Task *new_t);
+extern noreturn void task_switch_destroy (Task *old_t, Task *new_t,
+					  void *stack_top);
+
+// Offsets used by task_asm.nasm.
+static_assert (offsetof (Task, reg)         == 0x00, "Bad Task layout");
+static_assert (offsetof (Task, start_addr)  == 0x38, "Bad Task layout");
+static_assert (offsetof (Task, load_count)  == 0x40, "Bad Task layout");
+static_assert (offsetof (Task, stack_start) == 0x48, "Bad Task layout");
+static_assert (offsetof (Task, start_arg)   == 0x50, "Bad Task layout");
+static_assert (offsetof (Task, fpu_mode)    == 0x58, "Bad Task layout");
+static_assert (offsetof (Task, mxcsr)       == 0x5C, "Bad Task layout");
+static_assert (offsetof (Task, fpu_cw)      == 0x60, "Bad Task layout");
+static_assert (offsetof (Task, xsave_area)  == 0x68, "Bad Task layout");
+
+// Each thread that calls `task_setup` runs a scheduler instance of its own, so
+// all of the scheduler's state is kept per thread.
+#define TASK_LOCAL __thread
+
+// Where `task_switch_destroy` runs `task_raw_destroy`, once off the stack of
+// the task being destroyed. Freeing the task can take `free` down some deep
+// paths, so this is sized like a small task stack rather than a frame or two.
+#define TASK_DESTROY_STACK_SIZE 16384
+
+static TASK_LOCAL u8 task_destroy_stack[TASK_DESTROY_STACK_SIZE] ALIGN (16);
+
+/******************************************************************************
+ * Configuration.                                                             *
+ ******************************************************************************/
+
+// Set once by `task_setup`.
+static TASK_LOCAL Task_Config task_config;
+
+static bool
+task_config_valid (const Task_Config *c)
+{
+	return c -> task_count_max != 0
+		&& c -> task_count_max <= MAX_u16
+		&& c -> stack_size_min != 0
+		&& c -> stack_size_min <= c -> stack_size
+		&& c -> stack_size     <= c -> stack_size_max
+		&& c -> alloc_chunk_size >= 64;
+}
 
 /******************************************************************************
  * Task queue -- for scheduling TIDs.                                         *
  ******************************************************************************/
 
-static u16 task_queue[TASK_COUNT_MAX];
-static u16 task_queue_count = 0;
-static u16 task_queue_index = 0;
+/* Every policy provides the same set of static functions:
+ *
+ *   task_queue_current        : TID of the running task.
+ *   task_queue_next           : Picks the next task to run, making it current.
+ *   task_queue_add            : Makes a new TID runnable.
+ *   task_queue_make_current   : Marks an already-added TID as running.
+ *   task_queue_remove_current : Drops the running task from the queue.
+ *   task_queue_empty          : Tells if no TID is left to run.
+ *   task_queue_alone          : Tells if only the running TID is left.
+ *   task_queue_setup          : Allocates the queue, sized by `task_config`.
+ *
+ * Only one of them is compiled in, so the calls in `task_yield` are direct.
+ */
+
+#if TASK_SCHED_POLICY == TASK_SCHED_ROUND_ROBIN
+
+static TASK_LOCAL u16 *task_queue       = NULL;
+static TASK_LOCAL u16  task_queue_count = 0;
+static TASK_LOCAL u16  task_queue_index = 0;
+
+static bool
+task_queue_setup (void)
+{
+	task_queue = malloc (task_config.task_count_max * sizeof (u16));
+
+	return task_queue != NULL;
+}
 
 static void
 task_queue_increment (void)
@@ -81,160 +160,2340 @@ task_queue_remove_current (void)
 	}
 }
 
-/******************************************************************************
- * Task table, for associating TIDs with data.                                *
- ******************************************************************************/
-
-// Task table - Associate TID with task data.
-static Task *task_table [TASK_COUNT_MAX];
-
-static Task *
-task_table_lookup (Task_ID tid)
+static bool
+task_queue_empty (void)
 {
-	return task_table[tid];
+	return task_queue_count == 0;
 }
 
-static Task *
-task_table_new (void)
+static bool
+task_queue_alone (void)
 {
-	Task_ID tid = 0;
+	return task_queue_count <= 1;
+}
 
-	for (; tid < TASK_COUNT_MAX; tid++)
-		if (task_table[tid] == NULL)
-			break;
+#elif TASK_SCHED_POLICY == TASK_SCHED_LIFO \
+   || TASK_SCHED_POLICY == TASK_SCHED_FIFO
 
-	if (tid == TASK_COUNT_MAX)
-		return NULL;
+// Ring of waiting TIDs. The running task is kept outside of the ring, and is
+// pushed to the back when it yields.
+static TASK_LOCAL u16 *task_queue       = NULL;
+static TASK_LOCAL u16  task_queue_size  = 0;
+static TASK_LOCAL u16  task_queue_count = 0;
+static TASK_LOCAL u16  task_queue_head  = 0;
 
-	task_table[tid] = malloc (sizeof (Task));
+static TASK_LOCAL Task_ID task_queue_running        = 0;
+static TASK_LOCAL bool    task_queue_running_queued = false;
 
-	if (task_table[tid] == NULL)
-		return NULL;
-	
-	task_table[tid] -> id = tid;
+static bool
+task_queue_setup (void)
+{
+	task_queue_size = task_config.task_count_max;
+	task_queue      = malloc (task_queue_size * sizeof (u16));
 
-	return task_table[tid];
+	return task_queue != NULL;
 }
 
 static void
-task_table_delete (Task_ID tid)
+task_queue_push_back (Task_ID tid)
 {
-	free (task_table[tid]);
-	task_table[tid] = NULL;
+	task_queue[(task_queue_head + task_queue_count) % task_queue_size] = tid;
+	task_queue_count++;
 }
 
-/******************************************************************************
- * Handling of task data-structures.                                          *
- ******************************************************************************/
+#  if TASK_SCHED_POLICY == TASK_SCHED_LIFO
+static void
+task_queue_push_front (Task_ID tid)
+{
+	task_queue_head = (task_queue_head + task_queue_size - 1)
+		% task_queue_size;
+	task_queue[task_queue_head] = tid;
+	task_queue_count++;
+}
+#  endif
 
-Task *
-task_raw_create (void (*start)(void))
+static Task_ID
+task_queue_pop_front (void)
 {
-	Task *t = task_table_new();
+	Task_ID tid = task_queue[task_queue_head];
 
-	if (t == NULL)
-		return NULL;
+	task_queue_head++;
+	task_queue_head %= task_queue_size;
+	task_queue_count--;
 
-	t -> start_addr = (u64) start;
+	return tid;
+}
 
-	if (start != NULL)
+static Task_ID
+task_queue_current (void)
+{
+	return task_queue_running;
+}
+
+static Task_ID
+task_queue_next (void)
+{
+	if (task_queue_running_queued)
+		task_queue_push_back (task_queue_running);
+
+	// With nothing else to run, the current TID is returned as-is, which
+	// is what `task_terminate` checks for.
+	if (task_queue_count != 0)
 	{
-		t -> load_count   = 0;
-		t -> stack_start  = (u64) (malloc (TASK_STACK_SIZE));
-		t -> stack_start += TASK_STACK_SIZE; // Stacks grow downwards.
+		task_queue_running        = task_queue_pop_front();
+		task_queue_running_queued = true;
 	}
-	else
+
+	return task_queue_running;
+}
+
+static void
+task_queue_add (Task_ID tid)
+{
+#  if TASK_SCHED_POLICY == TASK_SCHED_LIFO
+	task_queue_push_front (tid);
+#  else
+	task_queue_push_back (tid);
+#  endif
+}
+
+static void
+task_queue_make_current (Task_ID tid)
+{
+	// Pull the TID back out of the ring, keeping the order of the rest.
+	for (u16 i = 0; i < task_queue_count; i++)
 	{
-		// For initializer thread, which has already been loaded and
-		// has a stack.
-		t -> load_count = 1;
-		t -> stack_start = 0;
+		u16 slot = (task_queue_head + i) % task_queue_size;
+
+		if (task_queue[slot] != tid)
+			continue;
+
+		for (; i + 1 < task_queue_count; i++)
+		{
+			u16 from = (task_queue_head + i + 1) % task_queue_size;
+
+			task_queue[slot] = task_queue[from];
+			slot = from;
+		}
+
+		task_queue_count--;
+		break;
 	}
 
-	return t;
+	task_queue_running        = tid;
+	task_queue_running_queued = true;
 }
 
-void
-task_raw_destroy (Task *t)
+static void
+task_queue_remove_current (void)
 {
-	if (t == NULL)
-		return;
-
-	if (t -> stack_start != 0)
+	if (!task_queue_running_queued)
 	{
-		u64 stack_base = t -> stack_start - TASK_STACK_SIZE;
-		
-		free ((void *) stack_base);
+		fputs ("Running task was already removed!", stderr);
+		abort();
 	}
-	
-	task_table_delete (t -> id);
+
+	task_queue_running_queued = false;
+}
+
+static bool
+task_queue_empty (void)
+{
+	return task_queue_count == 0 && !task_queue_running_queued;
 }
 
+static bool
+task_queue_alone (void)
+{
+	return task_queue_count == 0;
+}
+
+#else
+#  error "Unknown TASK_SCHED_POLICY."
+#endif
+
 /******************************************************************************
- * Tasking interface.                                                         *
+ * Task stacks -- pooled, or carved from a huge-page backed arena.            *
  ******************************************************************************/
 
-bool
-task_create (void (*start)(void))
+/* Arena layout, with slots indexed by TID:
+ *
+ *   Task     blocks[task_count_max], each in a TASK_BLOCK_SIZE slot
+ *   (padding to stack_size)
+ *   u8       stacks[task_count_max][stack_size]
+ *
+ * Blocks are kept together so that walking the table touches as few pages as
+ * possible. `Task` is packed, so slots are rounded up to whole cache lines:
+ * each block starts on a line of its own, with the registers `task_switch`
+ * touches in its first one, and no two tasks share a line. Only default-size
+ * stacks live in the arena; other sizes go through `malloc` either way.
+ */
+
+#define TASK_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define TASK_BLOCK_SIZE     ((sizeof (Task) + 63) & ~(usize) 63)
+
+static TASK_LOCAL u8   *task_arena             = NULL;
+static TASK_LOCAL usize task_arena_size        = 0;
+static TASK_LOCAL usize task_arena_blocks_size = 0;
+
+static TASK_LOCAL void **task_stack_pool       = NULL;
+static TASK_LOCAL u32    task_stack_pool_count = 0;
+
+// NUMA node a thread-per-core instance is pinned to, or -1.
+static TASK_LOCAL int task_arena_node = -1;
+
+// Asks for the arena's pages to come from the instance's own node, before any
+// are touched. Only a preference, and first touch by the pinned thread would
+// mostly get there anyway, so failure is ignored.
+static void
+task_arena_bind (void)
 {
-	Task *t = task_raw_create (start);
+	if (task_arena_node < 0 || task_arena_node >= 64)
+		return;
 
-	if (t == NULL)
+	unsigned long mask = 1UL << task_arena_node;
+
+	syscall (SYS_mbind, task_arena, task_arena_size, MPOL_PREFERRED,
+		 &mask, sizeof (mask) * 8, 0);
+}
+
+static bool
+task_arena_setup (void)
+{
+	usize count = task_config.task_count_max;
+
+	task_arena_blocks_size = ceil (count * TASK_BLOCK_SIZE,
+				       task_config.stack_size);
+	task_arena_size        = ceil (task_arena_blocks_size
+				       + count * task_config.stack_size,
+				       (usize) TASK_HUGE_PAGE_SIZE);
+
+	usize size = task_arena_size;
+
+	void *p = mmap (NULL, size,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+			-1, 0);
+
+	if (p != MAP_FAILED)
+	{
+		task_arena = p;
+		task_arena_bind();
+		return true;
+	}
+
+	// No huge pages reserved -- over-allocate so the arena can be aligned
+	// to a huge page, and ask for transparent huge pages instead.
+	p = mmap (NULL, size + TASK_HUGE_PAGE_SIZE,
+		  PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS,
+		  -1, 0);
+
+	if (p == MAP_FAILED)
 		return false;
 
-	task_queue_add (t -> id);
+	u64 start   = (u64) p;
+	u64 aligned = ceil (start, (u64) TASK_HUGE_PAGE_SIZE);
+	u64 end     = start + size + TASK_HUGE_PAGE_SIZE;
+
+	if (aligned != start)
+		munmap (p, aligned - start);
+
+	if (aligned + size != end)
+		munmap ((void *) (aligned + size), end - (aligned + size));
+
+	madvise ((void *) aligned, size, MADV_HUGEPAGE);
 
+	task_arena = (u8 *) aligned;
+	task_arena_bind();
 	return true;
 }
 
-noreturn void
-task_terminate (void)
+static bool
+task_in_arena (void *p)
 {
-	Task_ID cur_tid = task_queue_current();
-	task_queue_remove_current();
-	
-	Task_ID new_tid = task_queue_next();
+	return task_arena != NULL
+		&& (u8 *) p >= task_arena
+		&& (u8 *) p <  task_arena + task_arena_size;
+}
 
-	if (cur_tid != new_tid)
-	{
-		Task *cur_t = task_table_lookup (cur_tid);
-		Task *new_t = task_table_lookup (new_tid);
+static bool
+task_stack_pool_setup (void)
+{
+	if (task_config.stack_pool_count == 0)
+		return true;
 
-	        task_switch_destroy (cur_t, new_t);
-	}
-	else
+	task_stack_pool = malloc (task_config.stack_pool_count
+				  * sizeof (void *));
+
+	return task_stack_pool != NULL;
+}
+
+static Task *
+task_block_alloc (Task_ID tid)
+{
+	if (task_arena != NULL)
+		return (Task *) (task_arena + tid * TASK_BLOCK_SIZE);
+
+	return aligned_alloc (64, TASK_BLOCK_SIZE);
+}
+
+static void
+task_block_free (Task *t)
+{
+	if (!task_in_arena (t))
+		free (t);
+}
+
+// Returns the base (lowest address) of a stack for the given TID.
+static void *
+task_stack_alloc (Task_ID tid, usize size)
+{
+	if (size != task_config.stack_size)
+		return malloc (size);
+
+	if (task_arena != NULL)
+		return task_arena + task_arena_blocks_size + tid * size;
+
+	if (task_stack_pool_count != 0)
+		return task_stack_pool[--task_stack_pool_count];
+
+	return malloc (size);
+}
+
+static void
+task_stack_free (void *stack_base, usize size)
+{
+	if (task_in_arena (stack_base))
+		return;
+
+	if (size == task_config.stack_size
+	    && task_stack_pool_count < task_config.stack_pool_count)
 	{
-	        exit (0);
+		task_stack_pool[task_stack_pool_count++] = stack_base;
+		return;
 	}
+
+	free (stack_base);
 }
 
-void
-task_yield (void)
+/******************************************************************************
+ * Task allocation chunks.                                                    *
+ ******************************************************************************/
+
+typedef struct Task_Alloc_Chunk
 {
-	Task_ID cur_tid = task_queue_current();
-	Task_ID new_tid = task_queue_next();
+	struct Task_Alloc_Chunk *next;
+	usize                    size; // Including this header.
+	usize                    top;  // Offset of the first free byte.
+}
+Task_Alloc_Chunk;
 
-	if (cur_tid != new_tid)
+static TASK_LOCAL Task_Alloc_Chunk **task_alloc_pool       = NULL;
+static TASK_LOCAL u32                task_alloc_pool_count = 0;
+
+static bool
+task_alloc_pool_setup (void)
+{
+	if (task_config.alloc_pool_count == 0)
+		return true;
+
+	task_alloc_pool = malloc (task_config.alloc_pool_count
+				  * sizeof (Task_Alloc_Chunk *));
+
+	return task_alloc_pool != NULL;
+}
+
+static Task_Alloc_Chunk *
+task_alloc_chunk_new (usize size)
+{
+	Task_Alloc_Chunk *c;
+
+	if (size == task_config.alloc_chunk_size && task_alloc_pool_count != 0)
+		c = task_alloc_pool[--task_alloc_pool_count];
+	else
+		c = malloc (size);
+
+	if (c == NULL)
+		return NULL;
+
+	c -> next = NULL;
+	c -> size = size;
+	c -> top  = sizeof (Task_Alloc_Chunk);
+
+	return c;
+}
+
+// Frees every chunk a task holds.
+static void
+task_alloc_release (Task *t)
+{
+	Task_Alloc_Chunk *c = t -> alloc_chunk;
+
+	while (c != NULL)
 	{
-		Task *cur_t = task_table_lookup (cur_tid);
-		Task *new_t = task_table_lookup (new_tid);
-        
-		task_switch (cur_t, new_t);
+		Task_Alloc_Chunk *next = c -> next;
+
+		if (c -> size == task_config.alloc_chunk_size
+		    && task_alloc_pool_count < task_config.alloc_pool_count)
+			task_alloc_pool[task_alloc_pool_count++] = c;
+		else
+			free (c);
+
+		c = next;
 	}
+
+	t -> alloc_chunk = NULL;
+	t -> alloc_used  = 0;
+	t -> alloc_held  = 0;
 }
 
-bool
-task_setup (void)
+// Bumps `size` bytes off the chunk, if they fit.
+static void *
+task_alloc_bump (Task_Alloc_Chunk *c, usize size, usize align)
 {
-        Task *t = task_raw_create (NULL);
+	u64 base = (u64) c;
+	u64 addr = ceil (base + c -> top, (u64) align);
 
-	if (t == NULL)
-		return false;
+	if (addr - base > c -> size || size > c -> size - (addr - base))
+		return NULL;
 
-	task_queue_add (t -> id);
-	task_queue_make_current (t -> id);
+	c -> top = addr + size - base;
 
-	return true;
+	return (void *) addr;
+}
+
+/******************************************************************************
+ * Task table, for associating TIDs with data.                                *
+ ******************************************************************************/
+
+// Task table - Associate TID with task data.
+static TASK_LOCAL Task **task_table      = NULL;
+static TASK_LOCAL u32    task_table_used = 0; // TIDs taken.
+
+static bool
+task_table_setup (void)
+{
+	task_table      = calloc (task_config.task_count_max, sizeof (Task *));
+	task_table_used = 0;
+
+	return task_table != NULL;
+}
+
+static bool
+task_table_full (void)
+{
+	return task_table_used == task_config.task_count_max;
+}
+
+static Task *
+task_table_lookup (Task_ID tid)
+{
+	return task_table[tid];
+}
+
+static Task *
+task_table_new (void)
+{
+	Task_ID tid = 0;
+
+	for (; tid < task_config.task_count_max; tid++)
+		if (task_table[tid] == NULL)
+			break;
+
+	if (tid == task_config.task_count_max)
+		return NULL;
+
+	task_table[tid] = task_block_alloc (tid);
+
+	if (task_table[tid] == NULL)
+		return NULL;
+	
+	task_table[tid] -> id = tid;
+	task_table_used++;
+
+	return task_table[tid];
+}
+
+static void
+task_table_delete (Task_ID tid)
+{
+	task_block_free (task_table[tid]);
+	task_table[tid] = NULL;
+	task_table_used--;
+}
+
+/******************************************************************************
+ * Gates -- parked tasks that also wake on a timeout or an fd.                *
+ ******************************************************************************/
+
+/* Set up with `task_raw_gate`. A task's gate sits at `gate - 1` in the list,
+ * next to a `pollfd` for its fd (or -1, which `poll` skips), so the whole
+ * list can be handed to `poll` as is. Slot 0 of the pollfds is left for the
+ * inbox's eventfd, so that the idle scheduler can sleep on everything at once.
+ */
+
+typedef struct
+{
+	u64     wake_ns; // MAX_u64 without a timeout.
+	Task_ID tid;
+}
+Task_Gate;
+
+// How often fds are polled while there are other tasks to run.
+#define TASK_GATE_POLL_NS 100000
+
+static TASK_LOCAL Task_Gate     *task_gates         = NULL;
+static TASK_LOCAL struct pollfd *task_gate_fds      = NULL;
+static TASK_LOCAL u32            task_gate_count    = 0;
+static TASK_LOCAL u32            task_gate_fd_count = 0;
+static TASK_LOCAL u64            task_gate_next     = MAX_u64; // Earliest.
+static TASK_LOCAL u64            task_gate_polled   = 0;
+
+static bool
+task_gate_setup (void)
+{
+	task_gates    = malloc (task_config.task_count_max * sizeof (Task_Gate));
+	task_gate_fds = malloc ((task_config.task_count_max + 1)
+				* sizeof (struct pollfd));
+
+	task_gate_count    = 0;
+	task_gate_fd_count = 0;
+	task_gate_next     = MAX_u64;
+
+	return task_gates != NULL && task_gate_fds != NULL;
+}
+
+static u64
+task_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+}
+
+// Takes a task's gate out of the list, moving the last one into its place.
+static void
+task_gate_remove (Task *t)
+{
+	u32 i    = t -> gate - 1;
+	u32 last = --task_gate_count;
+
+	if (task_gate_fds[i + 1].fd >= 0)
+		task_gate_fd_count--;
+
+	if (i != last)
+	{
+		task_gates[i]        = task_gates[last];
+		task_gate_fds[i + 1] = task_gate_fds[last + 1];
+		task_table_lookup (task_gates[i].tid) -> gate = i + 1;
+	}
+
+	t -> gate = 0;
+}
+
+/* Wakes the tasks whose timeout is up at `now`, and, if `polled`, those `poll`
+ * just found their fd ready for.
+ */
+static void
+task_gate_open (u64 now, bool polled)
+{
+	u64 next = MAX_u64;
+
+	for (u32 i = 0; i < task_gate_count;)
+	{
+		if (now >= task_gates[i].wake_ns
+		    || (polled && task_gate_fds[i + 1].revents != 0))
+		{
+			Task *t = task_table_lookup (task_gates[i].tid);
+
+			// Whatever was last moves here.
+			task_gate_remove (t);
+			task_wake (t -> id);
+			continue;
+		}
+
+		next = min (next, task_gates[i].wake_ns);
+		i++;
+	}
+
+	task_gate_next = next;
+}
+
+// Checks the gates while there are other tasks to run. Timeouts are checked on
+// every call, but fds only every TASK_GATE_POLL_NS.
+static void
+task_gate_check (void)
+{
+	u64  now      = task_now_ns();
+	bool poll_due = task_gate_fd_count != 0
+		&& now - task_gate_polled >= TASK_GATE_POLL_NS;
+
+	if (!poll_due && now < task_gate_next)
+		return;
+
+	bool polled = false;
+
+	if (poll_due)
+	{
+		task_gate_polled = now;
+		polled = poll (task_gate_fds + 1, task_gate_count, 0) > 0;
+	}
+
+	task_gate_open (now, polled);
+}
+
+void
+task_raw_gate (Task *t, i64 timeout_ns, int fd, short events)
+{
+	if (t -> gate != 0)
+		task_gate_remove (t);
+
+	u32 i = task_gate_count++;
+
+	task_gates[i] = (Task_Gate)
+	{
+		.wake_ns = timeout_ns < 0
+			? MAX_u64
+			: task_now_ns() + (u64) timeout_ns,
+		.tid     = t -> id,
+	};
+	task_gate_fds[i + 1] = (struct pollfd)
+	{
+		.fd     = fd,
+		.events = events,
+	};
+
+	if (fd >= 0)
+		task_gate_fd_count++;
+
+	task_gate_next = min (task_gate_next, task_gates[i].wake_ns);
+	t -> gate      = i + 1;
+}
+
+/******************************************************************************
+ * Task inbox -- requests queued by other threads.                            *
+ ******************************************************************************/
+
+/* A bounded multi-producer, single-consumer queue. Producers claim a slot by
+ * bumping `tail`, and publish it through the slot's sequence number; the
+ * scheduler is the only consumer, so `head` is never shared.
+ *
+ * A create that finds the task table full stays where it is until a task ends
+ * and frees a TID, so it isn't lost. The scheduler's `scan` carries on past it
+ * to the requests behind, and marks each one done. Slots are handed back to
+ * producers from `head`, once everything up to them is done.
+ *
+ * When the scheduler has nothing to run it sets `idle` and sleeps on an
+ * eventfd, which producers only write to when they see that flag.
+ */
+
+static_assert ((TASK_INBOX_SIZE & (TASK_INBOX_SIZE - 1)) == 0,
+	       "TASK_INBOX_SIZE must be a power of two");
+
+enum
+{
+	TASK_INBOX_CREATE,
+	TASK_INBOX_WAKE,
+	TASK_INBOX_DONE, // Carried out, but not handed back yet.
+};
+
+typedef struct
+{
+	u64 seq;
+	u64 kind;
+	u64 data;
+	u64 arg;
+}
+Task_Inbox_Slot;
+
+typedef struct
+{
+	Task_Inbox_Slot slot[TASK_INBOX_SIZE];
+
+	u64 tail ALIGN(64);
+	u32 idle;
+	int event_fd;
+
+	u64 head ALIGN(64);
+	u64 scan; // Next request to look at; `head` unless creates are held.
+}
+Task_Inbox;
+
+// The running instance's inbox.
+static TASK_LOCAL Task_Inbox *task_inbox = NULL;
+
+static bool
+task_inbox_setup (Task_Inbox *inbox)
+{
+	for (u64 i = 0; i < TASK_INBOX_SIZE; i++)
+		inbox -> slot[i].seq = i;
+
+	inbox -> tail = 0;
+	inbox -> head = 0;
+	inbox -> scan = 0;
+	inbox -> idle = 0;
+
+	inbox -> event_fd = eventfd (0, EFD_CLOEXEC);
+
+	return inbox -> event_fd != -1;
+}
+
+static bool
+task_inbox_push (Task_Inbox *inbox, u64 kind, u64 data, u64 arg)
+{
+	u64 pos = __atomic_load_n (&inbox -> tail, __ATOMIC_RELAXED);
+
+	for (;;)
+	{
+		Task_Inbox_Slot *slot = &inbox -> slot[pos % TASK_INBOX_SIZE];
+
+		u64 seq  = __atomic_load_n (&slot -> seq, __ATOMIC_ACQUIRE);
+		i64 diff = (i64) (seq - pos);
+
+		if (diff < 0)
+			return false; // Full.
+
+		if (diff > 0)
+		{
+			pos = __atomic_load_n (&inbox -> tail,
+					       __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// On failure, `pos` is reloaded with the current tail.
+		if (__atomic_compare_exchange_n (&inbox -> tail, &pos, pos + 1,
+						 true,
+						 __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED))
+		{
+			slot -> kind = kind;
+			slot -> data = data;
+			slot -> arg  = arg;
+			__atomic_store_n (&slot -> seq, pos + 1,
+					  __ATOMIC_RELEASE);
+			break;
+		}
+	}
+
+	// Pairs with the fence in `task_inbox_wait`.
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n (&inbox -> idle, __ATOMIC_RELAXED))
+	{
+		u64 one = 1;
+
+		if (write (inbox -> event_fd, &one, sizeof (one)) < 0)
+			return false;
+	}
+
+	return true;
+}
+
+// Tells if the inbox holds nothing that can be carried out yet: no new
+// requests, and no held creates while the table is still full.
+static bool
+task_inbox_empty (void)
+{
+	if (task_inbox -> scan != task_inbox -> head && !task_table_full())
+		return false;
+
+	Task_Inbox_Slot *slot =
+		&task_inbox -> slot[task_inbox -> scan % TASK_INBOX_SIZE];
+
+	return __atomic_load_n (&slot -> seq, __ATOMIC_ACQUIRE)
+		!= task_inbox -> scan + 1;
+}
+
+// Set with `task_set_flush_hook`.
+static TASK_LOCAL void (*task_flush_hook)(void) = NULL;
+
+/* Blocks until some other thread has pushed to the inbox, a gate opens, or
+ * `timeout_ns` has passed if it isn't negative. Tasks whose gates opened are
+ * woken before returning.
+ */
+static void
+task_inbox_wait (i64 timeout_ns)
+{
+	if (task_flush_hook != NULL)
+		task_flush_hook();
+
+	__atomic_store_n (&task_inbox -> idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+	bool polled = false;
+
+	if (task_inbox_empty())
+	{
+		if (task_gate_next != MAX_u64)
+		{
+			u64 now  = task_now_ns();
+			i64 wait = task_gate_next > now
+				? (i64) (task_gate_next - now)
+				: 0;
+
+			if (timeout_ns < 0 || wait < timeout_ns)
+				timeout_ns = wait;
+		}
+
+		struct pollfd  *pfd = task_gate_fds;
+		struct timespec ts  =
+		{
+			.tv_sec  = timeout_ns / 1000000000,
+			.tv_nsec = timeout_ns % 1000000000,
+		};
+
+		pfd[0] = (struct pollfd)
+		{
+			.fd     = task_inbox -> event_fd,
+			.events = POLLIN,
+		};
+
+		int ready = ppoll (pfd, 1 + task_gate_count,
+				   timeout_ns < 0 ? NULL : &ts, NULL);
+
+		if (ready < 0 && errno != EINTR)
+		{
+			perror ("Task inbox wait failed");
+			abort();
+		}
+
+		u64 count;
+
+		if (ready > 0 && (pfd[0].revents & POLLIN)
+		    && read (task_inbox -> event_fd, &count, sizeof (count)) < 0
+		    && errno != EINTR)
+		{
+			perror ("Task inbox wait failed");
+			abort();
+		}
+
+		polled = ready > 0;
+	}
+
+	__atomic_store_n (&task_inbox -> idle, 0, __ATOMIC_RELAXED);
+
+	if (task_gate_count != 0)
+		task_gate_open (task_now_ns(), polled);
+}
+
+/******************************************************************************
+ * Scheduler instances.                                                       *
+ ******************************************************************************/
+
+/* The part of an instance other threads need: its inbox, and its switch and
+ * yield counts for `task_switches` and `task_yields`. Allocated by the
+ * instance's own thread, so with the rest of its state it ends up on that
+ * thread's NUMA node.
+ */
+typedef struct
+{
+	Task_Inbox inbox;
+
+	u64 switch_count ALIGN(64);
+	u64 yield_count;
+}
+Task_Instance;
+
+// Filled in as instances are set up, and never emptied.
+static Task_Instance *task_instances[TASK_INSTANCE_MAX];
+static u32            task_instance_next = 0; // First index not handed out.
+
+static TASK_LOCAL Task_Instance *task_self       = NULL;
+static TASK_LOCAL u32            task_self_index = 0;
+
+// Set for instances that wait for injected work once they run out of tasks,
+// rather than ending the process.
+static TASK_LOCAL bool task_self_stays = false;
+
+// Returns NULL for instances that aren't set up (yet).
+static Task_Instance *
+task_instance_lookup (u32 instance)
+{
+	if (instance >= TASK_INSTANCE_MAX)
+		return NULL;
+
+	return __atomic_load_n (&task_instances[instance], __ATOMIC_ACQUIRE);
+}
+
+// Hands out `count` consecutive indices, starting at `*first`. Nothing is
+// taken unless all of them fit.
+static bool
+task_instance_claim (u32 count, u32 *first)
+{
+	u32 next = __atomic_load_n (&task_instance_next, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (count > TASK_INSTANCE_MAX - next)
+			return false;
+	}
+	while (!__atomic_compare_exchange_n (&task_instance_next, &next,
+					     next + count, true,
+					     __ATOMIC_RELAXED,
+					     __ATOMIC_RELAXED));
+
+	*first = next;
+
+	return true;
+}
+
+// Gives back indices from `task_instance_claim` that no instance was set up
+// as. Only possible while nothing has been claimed after them; otherwise they
+// stay unused.
+static void
+task_instance_unclaim (u32 first, u32 count)
+{
+	u32 next = first + count;
+
+	__atomic_compare_exchange_n (&task_instance_next, &next, first, false,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Makes the calling thread's instance. Other threads can't see it until
+// `task_instance_publish`.
+static bool
+task_instance_setup (u32 index)
+{
+	Task_Instance *self = aligned_alloc (64, sizeof (Task_Instance));
+
+	if (self == NULL)
+		return false;
+
+	if (!task_inbox_setup (&self -> inbox))
+	{
+		free (self);
+		return false;
+	}
+
+	self -> switch_count = 0;
+	self -> yield_count  = 0;
+
+	task_self       = self;
+	task_self_index = index;
+	task_inbox      = &self -> inbox;
+
+	return true;
+}
+
+// Undoes `task_instance_setup` when the rest of the setup fails.
+static void
+task_instance_discard (void)
+{
+	close (task_self -> inbox.event_fd);
+	free (task_self);
+
+	task_self  = NULL;
+	task_inbox = NULL;
+}
+
+// Lets other threads inject into the calling thread's instance, once it's
+// ready to run what they send.
+static void
+task_instance_publish (void)
+{
+	__atomic_store_n (&task_instances[task_self_index], task_self,
+			  __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Deadline scheduling -- earliest deadline first, with CPU budgets.          *
+ ******************************************************************************/
+
+/* Deadline tasks which still have budget sit in `ready`, and those that have
+ * used it all up wait in `throttled` for their period to end. Both are
+ * min-heaps on the deadline, since a throttled task is replenished exactly
+ * when its deadline passes.
+ *
+ * A deadline task is never in the round-robin queue; while one is running
+ * the queue's current task is the last ordinary task that ran.
+ */
+
+typedef struct
+{
+	u64     key;
+	Task_ID tid;
+}
+Task_Heap_Entry;
+
+typedef struct
+{
+	Task_Heap_Entry *entry;
+	u16              count;
+}
+Task_Heap;
+
+static TASK_LOCAL Task_Heap task_edf_ready;
+static TASK_LOCAL Task_Heap task_edf_throttled;
+
+static bool
+task_edf_setup (void)
+{
+	usize size = task_config.task_count_max * sizeof (Task_Heap_Entry);
+
+	task_edf_ready.entry     = malloc (size);
+	task_edf_throttled.entry = malloc (size);
+
+	return task_edf_ready.entry != NULL && task_edf_throttled.entry != NULL;
+}
+
+// Deadline tasks that aren't parked, including a running one.
+static TASK_LOCAL u16     task_edf_count   = 0;
+static TASK_LOCAL bool    task_edf_active  = false;
+static TASK_LOCAL Task_ID task_edf_running = 0;
+
+static void
+task_heap_push (Task_Heap *h, u64 key, Task_ID tid)
+{
+	u32 i = h -> count++;
+
+	while (i > 0)
+	{
+		u32 parent = (i - 1) / 2;
+
+		if (h -> entry[parent].key <= key)
+			break;
+
+		h -> entry[i] = h -> entry[parent];
+		i = parent;
+	}
+
+	h -> entry[i] = (Task_Heap_Entry) { key, tid };
+}
+
+static Task_ID
+task_heap_pop (Task_Heap *h)
+{
+	Task_ID         top  = h -> entry[0].tid;
+	Task_Heap_Entry last = h -> entry[--h -> count];
+
+	u32 i = 0;
+
+	for (;;)
+	{
+		u32 child = i * 2 + 1;
+
+		if (child >= h -> count)
+			break;
+
+		if (child + 1 < h -> count
+		    && h -> entry[child + 1].key < h -> entry[child].key)
+			child++;
+
+		if (last.key <= h -> entry[child].key)
+			break;
+
+		h -> entry[i] = h -> entry[child];
+		i = child;
+	}
+
+	h -> entry[i] = last;
+
+	return top;
+}
+
+// Charges the running deadline task for the time since it was switched to.
+static void
+task_edf_charge (Task *t, u64 now)
+{
+	u64 used = now - t -> dl.slice_start;
+
+	if (used >= t -> dl.budget_left)
+		t -> dl.budget_left = 0;
+	else
+		t -> dl.budget_left -= used;
+}
+
+// Puts a deadline task in whichever heap fits, starting a new period first if
+// its current one is over.
+static void
+task_edf_insert (Task *t, u64 now)
+{
+	if (now >= t -> dl.deadline)
+	{
+		u64 missed = (now - t -> dl.deadline) / t -> dl.period + 1;
+
+		t -> dl.deadline   += missed * t -> dl.period;
+		t -> dl.budget_left = t -> dl.budget;
+	}
+
+	if (t -> dl.budget_left != 0)
+		task_heap_push (&task_edf_ready, t -> dl.deadline, t -> id);
+	else
+		task_heap_push (&task_edf_throttled, t -> dl.deadline, t -> id);
+}
+
+/******************************************************************************
+ * Time slices -- for `task_maybe_yield`, measured on the TSC.                *
+ ******************************************************************************/
+
+// The instance's switch count is bumped on every switch, so `task_maybe_yield`
+// can tell when the running task has been switched back in and is due a fresh
+// slice. Only written by the instance, but other threads read it through
+// `task_switches`.
+static inline void
+task_count_switch (void)
+{
+	u64 *count = &task_self -> switch_count;
+
+	__atomic_store_n (count, *count + 1, __ATOMIC_RELAXED);
+}
+
+// Bumped on every yield, switch or not, so that a task yielding with nothing
+// else to run can be told apart from one that never yields.
+static inline void
+task_count_yield (void)
+{
+	u64 *count = &task_self -> yield_count;
+
+	__atomic_store_n (count, *count + 1, __ATOMIC_RELAXED);
+}
+
+static TASK_LOCAL u64 task_slice_ticks  = 0; // `slice_ns`, in TSC ticks.
+static TASK_LOCAL u64 task_slice_start  = 0;
+static TASK_LOCAL u64 task_slice_switch = 0; // Switch count at the start.
+
+// Reading the TSC isn't free either (and traps under some hypervisors), so
+// it's only read every `stride` calls, with the stride adjusted to keep reads
+// a small fraction of a slice apart.
+static TASK_LOCAL u64 task_slice_last      = 0; // TSC at the last read.
+static TASK_LOCAL u32 task_slice_stride    = 1;
+static TASK_LOCAL u32 task_slice_countdown = 1;
+
+static inline u64
+task_rdtsc (void)
+{
+	return __builtin_ia32_rdtsc();
+}
+
+// Calibrates the TSC against the monotonic clock, over half a millisecond.
+static void
+task_slice_setup (void)
+{
+	u64 ns_start  = task_now_ns();
+	u64 tsc_start = task_rdtsc();
+	u64 ns_end;
+
+	while ((ns_end = task_now_ns()) - ns_start < 500000)
+		;
+
+	u64 ticks = task_rdtsc() - tsc_start;
+
+	task_slice_ticks  = (u64) ((double) ticks * task_config.slice_ns
+				   / (double) (ns_end - ns_start));
+	task_slice_start  = task_rdtsc();
+	task_slice_last   = task_slice_start;
+	task_slice_switch = task_self -> switch_count;
+}
+
+// Retunes the stride from the time since the last read.
+static void
+task_slice_pace (u64 now)
+{
+	u64 gap = now - task_slice_last;
+
+	if (gap < task_slice_ticks / 16 && task_slice_stride < 1024)
+		task_slice_stride *= 2;
+	else if (gap > task_slice_ticks / 4 && task_slice_stride > 1)
+		task_slice_stride /= 2;
+}
+
+/******************************************************************************
+ * FPU state.                                                                 *
+ ******************************************************************************/
+
+#define TASK_FPU_MXCSR_DEFAULT 0x1F80
+#define TASK_FPU_CW_DEFAULT    0x037F
+
+// Read by task_asm.nasm, which uses plain XSAVE without it.
+bool task_fpu_xsaveopt = false;
+
+// Read by task_asm.nasm, which clears the upper halves of the vector registers
+// with VZEROUPPER as TASK_FPU_FULL tasks leave the CPU, if set.
+bool task_fpu_avx = false;
+
+// Bytes XSAVE needs for the state components the OS has enabled, or 0 if it
+// can't be used.
+static u32 task_fpu_xsave_size = 0;
+
+// The CPU is the same for every instance, so this is only looked into once.
+static pthread_once_t task_fpu_once = PTHREAD_ONCE_INIT;
+
+static void
+task_fpu_setup (void)
+{
+	u32 a, b, c, d;
+
+	if (!__get_cpuid (1, &a, &b, &c, &d) || !(c & bit_OSXSAVE))
+		return;
+
+	// AVX also needs the OS to have enabled the SSE and AVX state in XCR0.
+	if (c & bit_AVX)
+	{
+		u32 xcr0_lo, xcr0_hi;
+
+		__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+		task_fpu_avx = (xcr0_lo & 6) == 6;
+	}
+
+	if (__get_cpuid_max (0, NULL) < 0xD)
+		return;
+
+	__cpuid_count (0xD, 0, a, b, c, d);
+	task_fpu_xsave_size = b;
+
+	__cpuid_count (0xD, 1, a, b, c, d);
+	task_fpu_xsaveopt = (a & bit_XSAVEOPT) != 0;
+}
+
+static void
+task_fpu_init (Task *t)
+{
+	t -> fpu_mode   = TASK_FPU_NONE;
+	t -> mxcsr      = TASK_FPU_MXCSR_DEFAULT;
+	t -> fpu_cw     = TASK_FPU_CW_DEFAULT;
+	t -> xsave_area = NULL;
+}
+
+// Returns a zeroed XSAVE area, which XRSTOR takes as the initial state, apart
+// from MXCSR, which it always loads.
+static void *
+task_fpu_xsave_new (void)
+{
+	usize size = ceil ((usize) task_fpu_xsave_size, (usize) 64);
+	u64  *area = aligned_alloc (64, size);
+
+	if (area == NULL)
+		return NULL;
+
+	// Word by word, as gcc would turn a byte loop into `memset`.
+	for (usize i = 0; i < size / 8; i++)
+		((volatile u64 *) area)[i] = 0;
+
+	((u32 *) area)[6] = TASK_FPU_MXCSR_DEFAULT; // Legacy area, + 24.
+
+	return area;
+}
+
+/******************************************************************************
+ * Handling of task data-structures.                                          *
+ ******************************************************************************/
+
+Task *
+task_raw_create (void (*start)(void))
+{
+	return task_raw_create_sized (start, task_config.stack_size);
+}
+
+Task *
+task_raw_create_sized (void (*start)(void), usize stack_size)
+{
+	stack_size = ceil (stack_size, (usize) 16);
+
+	if (stack_size < task_config.stack_size_min
+	    || stack_size > task_config.stack_size_max)
+		return NULL;
+
+	Task *t = task_table_new();
+
+	if (t == NULL)
+		return NULL;
+
+	t -> start_addr = (u64) start;
+	t -> start_arg  = 0;
+	t -> parked     = false;
+	t -> stackless  = false;
+	t -> gate       = 0;
+
+	t -> alloc_chunk = NULL;
+	t -> alloc_used  = 0;
+	t -> alloc_held  = 0;
+
+	t -> has_deadline = false;
+
+	task_fpu_init (t);
+
+	if (start != NULL)
+	{
+		void *stack_base = task_stack_alloc (t -> id, stack_size);
+
+		if (stack_base == NULL)
+		{
+			task_table_delete (t -> id);
+			return NULL;
+		}
+
+		t -> load_count     = 0;
+		t -> stack_size     = stack_size;
+		t -> stack_reserved = 0;
+		t -> stack_start    = (u64) stack_base;
+		t -> stack_start += stack_size; // Stacks grow downwards.
+	}
+	else
+	{
+		// For initializer thread, which has already been loaded and
+		// has a stack.
+		t -> load_count     = 1;
+		t -> stack_size     = 0;
+		t -> stack_reserved = 0;
+		t -> stack_start    = 0;
+	}
+
+	return t;
+}
+
+Task *
+task_raw_create_stackless (Task_Resume (*resume)(void *), void *arg)
+{
+	Task *t = task_table_new();
+
+	if (t == NULL)
+		return NULL;
+
+	t -> start_addr = (u64) resume;
+	t -> start_arg  = (u64) arg;
+	t -> parked     = false;
+	t -> stackless  = true;
+	t -> gate       = 0;
+
+	t -> alloc_chunk = NULL;
+	t -> alloc_used  = 0;
+	t -> alloc_held  = 0;
+
+	t -> has_deadline = false;
+
+	task_fpu_init (t);
+
+	// Never loaded, so never switched to.
+	t -> load_count     = 1;
+	t -> stack_size     = 0;
+	t -> stack_reserved = 0;
+	t -> stack_start    = 0;
+
+	return t;
+}
+
+void
+task_raw_destroy (Task *t)
+{
+	if (t == NULL)
+		return;
+
+	if (t -> stack_start != 0)
+	{
+		u64 stack_base = t -> stack_start + t -> stack_reserved
+			- t -> stack_size;
+		
+		task_stack_free ((void *) stack_base, t -> stack_size);
+	}
+
+	if (t -> gate != 0)
+		task_gate_remove (t);
+
+	task_alloc_release (t);
+	free (t -> xsave_area);
+	
+	task_table_delete (t -> id);
+}
+
+void *
+task_raw_stack_reserve (Task *t, usize size, usize align)
+{
+	if (t -> stack_start == 0 || t -> load_count != 0)
+		return NULL;
+
+	// Keep the stack itself 16-byte aligned underneath.
+	align = max (align, (usize) 16);
+
+	u64 top  = t -> stack_start + t -> stack_reserved;
+	u64 base = top - t -> stack_size;
+	u64 addr = floor (t -> stack_start - size, (u64) align);
+
+	if (size > t -> stack_start - base
+	    || addr - base < task_config.stack_size_min)
+		return NULL;
+
+	t -> stack_reserved = top - addr;
+	t -> stack_start    = addr;
+
+	return (void *) addr;
+}
+
+bool
+task_raw_set_fpu (Task *t, Task_FPU mode)
+{
+	if (mode == TASK_FPU_FULL && t -> xsave_area == NULL)
+	{
+		if (task_fpu_xsave_size == 0)
+			return false;
+
+		t -> xsave_area = task_fpu_xsave_new();
+
+		if (t -> xsave_area == NULL)
+			return false;
+	}
+	else if (mode != TASK_FPU_FULL)
+	{
+		free (t -> xsave_area);
+		t -> xsave_area = NULL;
+	}
+
+	t -> fpu_mode = mode;
+
+	return true;
+}
+
+void
+task_raw_enqueue (Task *t)
+{
+	task_queue_add (t -> id);
+}
+
+/******************************************************************************
+ * Tasking interface.                                                         *
+ ******************************************************************************/
+
+// Tasks parked and waiting on `task_wake`.
+static TASK_LOCAL u16 task_parked_count = 0;
+
+// Set just before each switch, so signal handlers can see which task they
+// interrupted without looking at the queue.
+static TASK_LOCAL Task *volatile task_running = NULL;
+
+bool
+task_create (void (*start)(void))
+{
+	Task *t = task_raw_create (start);
+
+	if (t == NULL)
+		return false;
+
+	task_queue_add (t -> id);
+
+	return true;
+}
+
+bool
+task_create_arg (void (*start)(void *), void *arg)
+{
+	Task *t = task_raw_create ((void (*)(void)) start);
+
+	if (t == NULL)
+		return false;
+
+	t -> start_arg = (u64) arg;
+	task_queue_add (t -> id);
+
+	return true;
+}
+
+bool
+task_create_sized (void (*start)(void), usize stack_bytes)
+{
+	Task *t = task_raw_create_sized (start, stack_bytes);
+
+	if (t == NULL)
+		return false;
+
+	task_queue_add (t -> id);
+
+	return true;
+}
+
+bool
+task_create_deadline (void (*start)(void), u64 period_ns, u64 budget_ns)
+{
+	// Without any budget the task would be throttled forever.
+	if (period_ns == 0 || budget_ns == 0 || budget_ns > period_ns)
+		return false;
+
+	Task *t = task_raw_create (start);
+
+	if (t == NULL)
+		return false;
+
+	u64 now = task_now_ns();
+
+	t -> has_deadline   = true;
+	t -> dl.period      = period_ns;
+	t -> dl.budget      = budget_ns;
+	t -> dl.deadline    = now + period_ns;
+	t -> dl.budget_left = budget_ns;
+
+	task_edf_count++;
+	task_edf_insert (t, now);
+
+	return true;
+}
+
+bool
+task_wake (Task_ID tid)
+{
+	Task *t = tid < task_config.task_count_max
+		? task_table_lookup (tid)
+		: NULL;
+
+	if (t == NULL || !t -> parked)
+		return false;
+
+	t -> parked = false;
+	task_parked_count--;
+
+	if (t -> gate != 0)
+		task_gate_remove (t);
+
+	if (t -> has_deadline)
+	{
+		task_edf_count++;
+		task_edf_insert (t, task_now_ns());
+	}
+	else
+	{
+		task_queue_add (tid);
+	}
+
+	return true;
+}
+
+// Carries out everything other threads have asked for since the last call,
+// apart from creates that still find the task table full.
+static void
+task_inbox_drain (void)
+{
+	Task_Inbox *inbox = task_inbox;
+
+	// Held creates go first, in order, once a TID is free.
+	if (inbox -> scan != inbox -> head && !task_table_full())
+		inbox -> scan = inbox -> head;
+
+	for (;; inbox -> scan++)
+	{
+		Task_Inbox_Slot *slot =
+			&inbox -> slot[inbox -> scan % TASK_INBOX_SIZE];
+
+		if (__atomic_load_n (&slot -> seq, __ATOMIC_ACQUIRE)
+		    != inbox -> scan + 1)
+			break;
+
+		switch (slot -> kind)
+		{
+		case TASK_INBOX_CREATE:
+			if (task_table_full())
+				continue; // Held.
+
+			if (!task_create_arg ((void (*)(void *)) slot -> data,
+					      (void *) slot -> arg))
+				fputs ("Failed to create injected task!\n",
+				       stderr);
+			break;
+
+		case TASK_INBOX_WAKE:
+			task_wake ((Task_ID) slot -> data);
+			break;
+
+		case TASK_INBOX_DONE:
+			continue;
+		}
+
+		slot -> kind = TASK_INBOX_DONE;
+	}
+
+	// Hand back the slots that are done with, up to the first held create.
+	while (inbox -> head != inbox -> scan)
+	{
+		Task_Inbox_Slot *slot =
+			&inbox -> slot[inbox -> head % TASK_INBOX_SIZE];
+
+		if (slot -> kind != TASK_INBOX_DONE)
+			break;
+
+		__atomic_store_n (&slot -> seq, inbox -> head + TASK_INBOX_SIZE,
+				  __ATOMIC_RELEASE);
+		inbox -> head++;
+	}
+}
+
+static Task_ID
+task_sched_current (void)
+{
+	return task_edf_active ? task_edf_running : task_queue_current();
+}
+
+// Takes the running deadline task out of the running slot, charging it for
+// its slice. It's put back in a heap unless it's leaving.
+static void
+task_edf_stop (bool leaving)
+{
+	Task *t   = task_table_lookup (task_edf_running);
+	u64   now = task_now_ns();
+
+	task_edf_charge (t, now);
+	task_edf_active = false;
+
+	if (leaving)
+		task_edf_count--;
+	else
+		task_edf_insert (t, now);
+}
+
+// Picks the next task with deadline tasks around. If only throttled deadline
+// tasks are left, waits (for other threads, too) until the first is
+// replenished. `cur_tid` is returned when nothing at all is runnable.
+static Task_ID
+task_edf_next (Task_ID cur_tid)
+{
+	if (task_edf_active)
+		task_edf_stop (false);
+
+	for (;;)
+	{
+		u64 now = task_now_ns();
+
+		while (task_edf_throttled.count != 0
+		       && task_edf_throttled.entry[0].key <= now)
+		{
+			Task_ID tid = task_heap_pop (&task_edf_throttled);
+
+			task_edf_insert (task_table_lookup (tid), now);
+		}
+
+		if (task_edf_ready.count != 0)
+		{
+			Task_ID tid = task_heap_pop (&task_edf_ready);
+
+			task_table_lookup (tid) -> dl.slice_start = now;
+			task_edf_active  = true;
+			task_edf_running = tid;
+
+			return tid;
+		}
+
+		if (!task_queue_empty())
+			return task_queue_next();
+
+		if (task_edf_throttled.count == 0)
+			return cur_tid;
+
+		task_inbox_wait (task_edf_throttled.entry[0].key - now);
+		task_inbox_drain();
+	}
+}
+
+// Picks the next task to run, making it current. The running task must
+// already be off the queue if it isn't runnable anymore.
+static Task_ID
+task_sched_next (Task_ID cur_tid)
+{
+	if (task_gate_count != 0)
+		task_gate_check();
+
+	// A running deadline task is counted, so this is the plain queue. An
+	// empty queue goes the long way, since the running task may not be in
+	// it for `task_queue_next` to hand back.
+	if (task_edf_count == 0 && !task_queue_empty())
+		return task_queue_next();
+
+	return task_edf_next (cur_tid);
+}
+
+// Takes the running task off the queue (or out of the deadline class).
+static void
+task_sched_remove_current (void)
+{
+	if (task_edf_active)
+		task_edf_stop (true);
+	else
+		task_queue_remove_current();
+}
+
+/* Runs stackless tasks picked after `cur_tid` inline, on the running task's
+ * stack, until the pick is a task that needs switching to. Returns `cur_tid`
+ * if the running task comes up again, or if nothing is left runnable.
+ */
+static Task_ID
+task_sched_run_stackless (Task_ID cur_tid, Task_ID new_tid)
+{
+	Task *cur_t = task_running;
+
+	while (new_tid != cur_tid)
+	{
+		Task *t = task_table_lookup (new_tid);
+
+		if (!t -> stackless)
+			break;
+
+		Task_Resume (*resume)(void *) = (Task_Resume (*)(void *))
+			t -> start_addr;
+
+		task_running = t;
+		task_count_switch();
+
+		Task_Resume result = resume ((void *) t -> start_arg);
+
+		task_running = cur_t;
+
+		if (result != TASK_RESUME_YIELD)
+		{
+			task_queue_remove_current();
+
+			if (result == TASK_RESUME_PARK)
+			{
+				t -> parked = true;
+				task_parked_count++;
+			}
+			else
+			{
+				task_raw_destroy (t);
+			}
+		}
+
+		if (!task_inbox_empty())
+			task_inbox_drain();
+
+		Task_ID next_tid = task_sched_next (new_tid);
+
+		// Only handed back when the queue has nothing else.
+		if (next_tid == new_tid && result != TASK_RESUME_YIELD)
+			return cur_tid;
+
+		new_tid = next_tid;
+	}
+
+	return new_tid;
+}
+
+// Picks the next task once the current one has left the queue, sleeping until
+// other threads send work while nothing is runnable. A parking task waits for
+// its own wake, while a terminating one waits for any parked task's (or, on
+// instances that stay, for any work at all).
+static Task_ID
+task_next_after_removal (Task_ID cur_tid, bool parking)
+{
+	Task   *cur_t   = task_table_lookup (cur_tid);
+	Task_ID new_tid = task_sched_next (cur_tid);
+
+	new_tid = task_sched_run_stackless (cur_tid, new_tid);
+
+	while (new_tid == cur_tid
+	       && (parking
+		   ? cur_t -> parked
+		   : task_parked_count != 0 || task_self_stays))
+	{
+		task_inbox_wait (-1);
+		task_inbox_drain();
+		new_tid = task_sched_next (cur_tid);
+		new_tid = task_sched_run_stackless (cur_tid, new_tid);
+	}
+
+	return new_tid;
+}
+
+noreturn void
+task_terminate (void)
+{
+	if (task_flush_hook != NULL)
+		task_flush_hook();
+
+	task_inbox_drain();
+
+	Task_ID cur_tid = task_sched_current();
+	task_sched_remove_current();
+
+	// Parked tasks can still be woken by other threads, so only exit once
+	// there are none left.
+	Task_ID new_tid = task_next_after_removal (cur_tid, false);
+
+	if (cur_tid != new_tid)
+	{
+		Task *cur_t = task_table_lookup (cur_tid);
+		Task *new_t = task_table_lookup (new_tid);
+
+		task_running = new_t;
+		task_count_switch();
+	        task_switch_destroy (cur_t, new_t, task_destroy_stack
+				     + TASK_DESTROY_STACK_SIZE);
+	}
+	else
+	{
+	        exit (0);
+	}
+}
+
+void
+task_yield (void)
+{
+	task_count_yield();
+
+	if (!task_inbox_empty())
+		task_inbox_drain();
+
+	Task_ID cur_tid = task_sched_current();
+	Task_ID new_tid = task_sched_next (cur_tid);
+
+	if (cur_tid != new_tid)
+	{
+		Task *cur_t = task_table_lookup (cur_tid);
+		Task *new_t = task_table_lookup (new_tid);
+
+		if (new_t -> stackless)
+		{
+			new_tid = task_sched_run_stackless (cur_tid, new_tid);
+
+			if (new_tid == cur_tid)
+				return;
+
+			new_t = task_table_lookup (new_tid);
+		}
+        
+		task_running = new_t;
+		task_count_switch();
+		task_switch (cur_t, new_t);
+	}
+}
+
+void
+task_maybe_yield (void)
+{
+	// First call since being switched back in. The stride was paced to
+	// whoever ran last, so it starts over.
+	if (task_slice_switch != task_self -> switch_count)
+	{
+		task_slice_switch    = task_self -> switch_count;
+		task_slice_start     = task_rdtsc();
+		task_slice_last      = task_slice_start;
+		task_slice_stride    = 1;
+		task_slice_countdown = 1;
+		return;
+	}
+
+	if (--task_slice_countdown != 0)
+		return;
+
+	u64 now = task_rdtsc();
+
+	task_slice_pace (now);
+	task_slice_last      = now;
+	task_slice_countdown = task_slice_stride;
+
+	if (now - task_slice_start < task_slice_ticks)
+		return;
+
+	// Tasks whose gates are due are somebody to hand the CPU to.
+	if (task_gate_count != 0)
+		task_gate_check();
+
+	// Nobody to hand the CPU to, so just start another slice.
+	if (task_edf_count == 0 && task_queue_alone() && task_inbox_empty())
+	{
+		task_count_yield();
+		task_slice_start = now;
+		return;
+	}
+
+	task_yield();
+
+	task_slice_switch    = task_self -> switch_count;
+	task_slice_start     = task_rdtsc();
+	task_slice_last      = task_slice_start;
+	task_slice_stride    = 1;
+	task_slice_countdown = 1;
+}
+
+Task_ID
+task_current_id (void)
+{
+	return task_sched_current();
+}
+
+Task *
+task_current (void)
+{
+	return task_running;
+}
+
+u32
+task_instance (void)
+{
+	return task_self_index;
+}
+
+u64
+task_switches (u32 instance)
+{
+	Task_Instance *i = task_instance_lookup (instance);
+
+	return i != NULL
+		? __atomic_load_n (&i -> switch_count, __ATOMIC_RELAXED)
+		: 0;
+}
+
+u64
+task_yields (u32 instance)
+{
+	Task_Instance *i = task_instance_lookup (instance);
+
+	return i != NULL
+		? __atomic_load_n (&i -> yield_count, __ATOMIC_RELAXED)
+		: 0;
+}
+
+bool
+task_sleeping (u32 instance)
+{
+	Task_Instance *i = task_instance_lookup (instance);
+
+	return i != NULL
+		&& __atomic_load_n (&i -> inbox.idle, __ATOMIC_RELAXED) != 0;
+}
+
+void
+task_park (void)
+{
+	Task_ID cur_tid = task_sched_current();
+	Task   *cur_t   = task_table_lookup (cur_tid);
+
+	cur_t -> parked = true;
+	task_parked_count++;
+	task_sched_remove_current();
+
+	// Only drain once parked, so a wake another thread sent after the task
+	// last checked whatever it waits on isn't dropped.
+	task_inbox_drain();
+
+	// If the wake arrives while waiting, the task is simply picked again.
+	Task_ID new_tid = task_next_after_removal (cur_tid, true);
+
+	if (cur_tid != new_tid)
+	{
+		Task *new_t = task_table_lookup (new_tid);
+
+		task_running = new_t;
+		task_count_switch();
+		task_switch (cur_t, new_t);
+	}
+}
+
+void
+task_set_flush_hook (void (*hook)(void))
+{
+	task_flush_hook = hook;
+}
+
+// Sets up an instance, as `index`, for the calling thread.
+static bool
+task_setup_instance (const Task_Config *config, u32 index)
+{
+	task_config = config != NULL ? *config : TASK_CONFIG_DEFAULT;
+
+	// Rounded like every size `task_raw_create_sized` is asked for, so the
+	// default size still matches the pool's and the arena's.
+	task_config.stack_size     = ceil (task_config.stack_size, (usize) 16);
+	task_config.stack_size_min = ceil (task_config.stack_size_min, (usize) 16);
+	task_config.stack_size_max = ceil (task_config.stack_size_max, (usize) 16);
+
+	if (!task_config_valid (&task_config))
+		return false;
+
+	if (task_config.arena && !task_arena_setup())
+		return false;
+
+	if (!task_queue_setup()
+	    || !task_table_setup()
+	    || !task_stack_pool_setup()
+	    || !task_alloc_pool_setup()
+	    || !task_edf_setup()
+	    || !task_gate_setup()
+	    || !task_instance_setup (index))
+		return false;
+
+	task_slice_setup();
+	pthread_once (&task_fpu_once, task_fpu_setup);
+
+        Task *t = task_raw_create (NULL);
+
+	if (t == NULL)
+	{
+		task_instance_discard();
+		return false;
+	}
+
+	task_queue_add (t -> id);
+	task_queue_make_current (t -> id);
+	task_running = t;
+
+	task_instance_publish();
+
+	return true;
+}
+
+bool
+task_setup (const Task_Config *config)
+{
+	u32 index;
+
+	if (!task_instance_claim (1, &index))
+		return false;
+
+	if (!task_setup_instance (config, index))
+	{
+		task_instance_unclaim (index, 1);
+		return false;
+	}
+
+	return true;
+}
+
+/******************************************************************************
+ * Task allocation.                                                           *
+ ******************************************************************************/
+
+void *
+task_alloc (usize size)
+{
+	return task_alloc_aligned (size, 16);
+}
+
+void *
+task_alloc_aligned (usize size, usize align)
+{
+	Task             *t    = task_running;
+	Task_Alloc_Chunk *head = t -> alloc_chunk;
+	void             *p    = NULL;
+
+	if (head != NULL)
+		p = task_alloc_bump (head, size, align);
+
+	if (p == NULL)
+	{
+		usize chunk_size = task_config.alloc_chunk_size;
+		usize need       = sizeof (Task_Alloc_Chunk) + align;
+
+		if (size > MAX_u64 / 2)
+			return NULL;
+
+		need += size;
+
+		// Big allocations get a chunk of their own, which goes behind
+		// the newest one so what's left of that isn't wasted.
+		Task_Alloc_Chunk *c = task_alloc_chunk_new (max (need,
+								 chunk_size));
+
+		if (c == NULL)
+			return NULL;
+
+		if (need > chunk_size && head != NULL)
+		{
+			c -> next    = head -> next;
+			head -> next = c;
+		}
+		else
+		{
+			c -> next        = head;
+			t -> alloc_chunk = c;
+		}
+
+		t -> alloc_held += c -> size;
+		p = task_alloc_bump (c, size, align);
+	}
+
+	t -> alloc_used += size;
+
+	return p;
+}
+
+/******************************************************************************
+ * Fork-join.                                                                 *
+ ******************************************************************************/
+
+// Shared by every task spawned from one `task_parallel_for` call, and kept on
+// the caller's stack, which outlives them all.
+typedef struct
+{
+	usize grain;
+	void (*body)(usize begin, usize end, void *ctx);
+	void *ctx;
+
+	u64     pending;
+	Task_ID waiter;
+	bool    waiting;
+}
+Task_Fork;
+
+typedef struct
+{
+	usize      begin;
+	usize      end;
+	Task_Fork *fork;
+}
+Task_Range;
+
+static void
+task_parallel_for_entry (void *arg)
+{
+	Task_Range *r    = arg;
+	Task_Fork  *fork = r -> fork;
+
+	task_parallel_for (r -> begin, r -> end, fork -> grain,
+			   fork -> body, fork -> ctx);
+
+	fork -> pending--;
+
+	if (fork -> pending == 0 && fork -> waiting)
+		task_wake (fork -> waiter);
+}
+
+// Runs a range that couldn't get a task of its own, in chunks of at most
+// `grain` items all the same.
+static void
+task_parallel_for_inline (usize begin, usize end, const Task_Fork *fork)
+{
+	while (begin < end)
+	{
+		usize stop = end - begin > fork -> grain
+			? begin + fork -> grain
+			: end;
+
+		fork -> body (begin, stop, fork -> ctx);
+		begin = stop;
+	}
+}
+
+void
+task_parallel_for (usize begin, usize end, usize grain,
+		   void (*body)(usize begin, usize end, void *ctx),
+		   void *ctx)
+{
+	Task_Fork fork =
+	{
+		.grain   = grain != 0 ? grain : 1,
+		.body    = body,
+		.ctx     = ctx,
+		.pending = 0,
+		.waiter  = task_current_id(),
+		.waiting = false,
+	};
+
+	// Halving means at most one split per bit of the range.
+	Task_Range range[sizeof (usize) * 8];
+	u8 spawned = 0;
+
+	while (end > begin && end - begin > fork.grain)
+	{
+		usize mid = begin + (end - begin) / 2;
+
+		range[spawned] = (Task_Range) { mid, end, &fork };
+
+		// Later splits may still find a task, as others finish.
+		if (task_create_arg (task_parallel_for_entry, &range[spawned]))
+		{
+			spawned++;
+			fork.pending++;
+		}
+		else
+		{
+			task_parallel_for_inline (mid, end, &fork);
+		}
+
+		end = mid;
+	}
+
+	if (end > begin)
+		body (begin, end, ctx);
+
+	while (fork.pending != 0)
+	{
+		fork.waiting = true;
+		task_park();
+		fork.waiting = false;
+	}
+}
+
+/******************************************************************************
+ * Cross-thread interface.                                                    *
+ ******************************************************************************/
+
+static bool
+task_inject (u32 instance, u64 kind, u64 data, u64 arg)
+{
+	Task_Instance *i = task_instance_lookup (instance);
+
+	return i != NULL && task_inbox_push (&i -> inbox, kind, data, arg);
+}
+
+bool
+task_inject_create (void (*start)(void))
+{
+	return task_inject (0, TASK_INBOX_CREATE, (u64) start, 0);
+}
+
+bool
+task_inject_wake (Task_ID tid)
+{
+	return task_inject (0, TASK_INBOX_WAKE, tid, 0);
+}
+
+bool
+task_inject_wake_on (u32 instance, Task_ID tid)
+{
+	return task_inject (instance, TASK_INBOX_WAKE, tid, 0);
+}
+
+bool
+task_create_on (u32 instance, void (*start)(void *), void *arg)
+{
+	if (task_self != NULL && instance == task_self_index)
+		return task_create_arg (start, arg);
+
+	return task_inject (instance, TASK_INBOX_CREATE, (u64) start,
+			    (u64) arg);
+}
+
+/******************************************************************************
+ * Thread-per-core instances.                                                 *
+ ******************************************************************************/
+
+enum
+{
+	TASK_CORE_PENDING,
+	TASK_CORE_READY,
+	TASK_CORE_FAILED,
+};
+
+// Handed to each instance's thread. Freed once they are all ready or failed.
+typedef struct
+{
+	const Task_Config *config;
+	u32                index;
+	int                cpu;
+	void             (*start)(void *);
+	void              *arg;
+	int                state;
+}
+Task_Core;
+
+// Pins the calling thread to the core, so that everything the instance
+// allocates is first touched from there, and sets it up.
+static bool
+task_core_setup (Task_Core *core)
+{
+	cpu_set_t set;
+
+	CPU_ZERO (&set);
+	CPU_SET (core -> cpu, &set);
+
+	if (pthread_setaffinity_np (pthread_self(), sizeof (set), &set) != 0)
+		return false;
+
+	unsigned int cpu, node;
+
+	if (getcpu (&cpu, &node) == 0)
+		task_arena_node = node;
+
+	return task_setup_instance (core -> config, core -> index);
+}
+
+static void *
+task_core_main (void *arg)
+{
+	Task_Core *core = arg;
+	void     (*start)(void *) = core -> start;
+	void      *start_arg      = core -> arg;
+	bool       ready          = task_core_setup (core);
+
+	__atomic_store_n (&core -> state,
+			  ready ? TASK_CORE_READY : TASK_CORE_FAILED,
+			  __ATOMIC_RELEASE);
+
+	if (!ready)
+		return NULL;
+
+	task_self_stays = true;
+	start (start_arg);
+	task_terminate();
+}
+
+u32
+task_setup_per_core (const Task_Config *config,
+		     void (*start)(void *), void *arg)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity (0, sizeof (set), &set) != 0)
+		return 0;
+
+	u32 count = CPU_COUNT (&set);
+	u32 first;
+
+	if (count == 0 || !task_instance_claim (count, &first))
+		return 0;
+
+	Task_Core *cores = malloc (count * sizeof (Task_Core));
+
+	if (cores == NULL)
+	{
+		task_instance_unclaim (first, count);
+		return 0;
+	}
+
+	for (int cpu = 0, n = 0; n < (int) count; cpu++)
+	{
+		if (!CPU_ISSET (cpu, &set))
+			continue;
+
+		cores[n] = (Task_Core)
+		{
+			.config = config,
+			.index  = first + n,
+			.cpu    = cpu,
+			.start  = start,
+			.arg    = arg,
+			.state  = TASK_CORE_PENDING,
+		};
+		n++;
+	}
+
+	// The calling thread takes the first core, and nothing else is started
+	// unless it can.
+	if (!task_core_setup (&cores[0]))
+	{
+		task_instance_unclaim (first, count);
+		free (cores);
+		return 0;
+	}
+
+	for (u32 i = 1; i < count; i++)
+	{
+		pthread_t thread;
+
+		if (pthread_create (&thread, NULL, task_core_main,
+				    &cores[i]) != 0)
+			cores[i].state = TASK_CORE_FAILED;
+		else
+			pthread_detach (thread);
+	}
+
+	// Wait for the rest, so nobody injects into an instance that isn't
+	// there yet.
+	u32 ready = 1;
+
+	for (u32 i = 1; i < count; i++)
+	{
+		int state;
+
+		while ((state = __atomic_load_n (&cores[i].state,
+						 __ATOMIC_ACQUIRE))
+		       == TASK_CORE_PENDING)
+			sched_yield();
+
+		if (state == TASK_CORE_READY)
+			ready++;
+	}
+
+	free (cores);
+
+	return ready;
 }
 
 /* ----------------------------------- EOF ---------------------------------- */
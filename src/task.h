@@ -9,10 +9,18 @@
 
 #include <std/int.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /******************************************************************************
  * Configuration.                                                             *
  ******************************************************************************/
 
+/* The sizing macros below are only the defaults for `Task_Config`; see
+ * `task_setup`.
+ */
+
 #ifndef   TASK_COUNT_MAX
 #  define TASK_COUNT_MAX 64
 #endif
@@ -21,6 +29,75 @@
 #  define TASK_STACK_SIZE 16384
 #endif
 
+// Bounds on the stack sizes `task_create_sized` accepts.
+#ifndef   TASK_STACK_SIZE_MIN
+#  define TASK_STACK_SIZE_MIN 4096
+#endif
+
+#ifndef   TASK_STACK_SIZE_MAX
+#  define TASK_STACK_SIZE_MAX (8 * 1024 * 1024)
+#endif
+
+// Freed default-size stacks kept around for the next task instead of going
+// back to the allocator.
+#ifndef   TASK_STACK_POOL_COUNT
+#  define TASK_STACK_POOL_COUNT 16
+#endif
+
+// Size of the chunks `task_alloc` carves allocations from, header included.
+// Larger allocations get a chunk of their own.
+#ifndef   TASK_ALLOC_CHUNK_SIZE
+#  define TASK_ALLOC_CHUNK_SIZE 8192
+#endif
+
+// Freed default-size allocation chunks kept for reuse by other tasks.
+#ifndef   TASK_ALLOC_POOL_COUNT
+#  define TASK_ALLOC_POOL_COUNT 64
+#endif
+
+/* Scheduling policies, selected at compile-time through `TASK_SCHED_POLICY`
+ * so that `task_yield` never goes through a function pointer.
+ *
+ *   TASK_SCHED_ROUND_ROBIN : Rotate through the queue. Removing a task moves
+ *                            the last task into its place.
+ *   TASK_SCHED_LIFO        : Newly created tasks run next, while the data
+ *                            their creator just touched is still cache-hot.
+ *   TASK_SCHED_FIFO        : Strict arrival order, for both new tasks and
+ *                            tasks that yield.
+ */
+#define TASK_SCHED_ROUND_ROBIN 0
+#define TASK_SCHED_LIFO        1
+#define TASK_SCHED_FIFO        2
+
+#ifndef   TASK_SCHED_POLICY
+#  define TASK_SCHED_POLICY TASK_SCHED_ROUND_ROBIN
+#endif
+
+// When set, task blocks and default-size stacks are carved out of one mapping
+// backed by 2 MiB pages instead of being `malloc`'d one by one, so switching
+// between tasks stays within a handful of TLB entries. Explicit huge pages
+// are tried first, falling back to transparent huge pages.
+#ifndef   TASK_ARENA
+#  define TASK_ARENA 0
+#endif
+
+// Time a task may run between switches in `task_maybe_yield`.
+#ifndef   TASK_SLICE_NS
+#  define TASK_SLICE_NS 100000
+#endif
+
+// Number of pending requests other threads can queue up for the scheduler.
+// Must be a power of two.
+#ifndef   TASK_INBOX_SIZE
+#  define TASK_INBOX_SIZE 256
+#endif
+
+// Scheduler instances (threads calling `task_setup`, or cores given to
+// `task_setup_per_core`) a process can have.
+#ifndef   TASK_INSTANCE_MAX
+#  define TASK_INSTANCE_MAX 256
+#endif
+
 /******************************************************************************
  * Tasking structures.                                                        *
  ******************************************************************************/
@@ -39,17 +116,94 @@ typedef struct
 }
 PACKED Task_Registers;
 
+// Deadline-class scheduling state. Times are CLOCK_MONOTONIC nanoseconds.
+typedef struct
+{
+	u64 period;      // Length of each period, which is also the deadline.
+	u64 budget;      // CPU time allowed per period.
+	u64 deadline;    // End of the current period.
+	u64 budget_left; // CPU time left in the current period.
+	u64 slice_start; // When the task was last switched to.
+}
+Task_Deadline;
+
+// What a stackless task's resume function hands back to the scheduler.
+typedef enum
+{
+	TASK_RESUME_YIELD, // Stays runnable.
+	TASK_RESUME_PARK,  // Waits for `task_wake`.
+	TASK_RESUME_DONE,  // Is destroyed.
+}
+Task_Resume;
+
+// How much FPU/SIMD state a task keeps across switches.
+typedef enum
+{
+	TASK_FPU_NONE,    // Nothing -- the cheapest switch.
+	TASK_FPU_CONTROL, // MXCSR and the x87 control word.
+	TASK_FPU_FULL,    // Everything XSAVE covers, control words included.
+}
+Task_FPU;
+
 typedef struct
 {
 	Task_Registers reg; // + 0x00
 	u64 start_addr;     // + 0x38
 	u64 load_count;     // + 0x40
 	u64 stack_start;    // + 0x48
+	u64 start_arg;      // + 0x50
+	u32 fpu_mode;       // + 0x58 -- a `Task_FPU`.
+	u32 mxcsr;          // + 0x5C
+	u16 fpu_cw;         // + 0x60 -- x87 control word.
+	u16 fpu_pad[3];
+	void *xsave_area;   // + 0x68 -- 64-byte aligned, for TASK_FPU_FULL.
+	usize stack_size;
+	usize stack_reserved; // Taken off the top by `task_raw_stack_reserve`.
 	
 	Task_ID id;
+	bool    parked;
+	bool    stackless; // Resumed by calling `start_addr (start_arg)`.
+	u32     gate;      // Index + 1 in the scheduler's gates, or 0.
+
+	void *alloc_chunk; // Newest chunk `task_alloc` is carving from.
+	usize alloc_used;  // Bytes handed out by `task_alloc`.
+	usize alloc_held;  // Bytes of chunks held for them.
+
+	bool          has_deadline;
+	Task_Deadline dl;
 }
 PACKED Task;
 
+// Runtime configuration, passed to `task_setup`. Stack sizes are rounded up to
+// a multiple of 16 bytes.
+typedef struct
+{
+	u32   task_count_max;   // Size of the task table, up to MAX_u16.
+	usize stack_size;       // Stack size for `task_create` and friends.
+	usize stack_size_min;   // Bounds for `task_create_sized`.
+	usize stack_size_max;
+	u32   stack_pool_count; // Freed default-size stacks kept for reuse.
+	bool  arena;            // Use the huge-page arena (see `TASK_ARENA`).
+	u64   slice_ns;         // Time slice for `task_maybe_yield`.
+	usize alloc_chunk_size; // Chunk size for `task_alloc`.
+	u32   alloc_pool_count; // Freed default-size chunks kept for reuse.
+}
+Task_Config;
+
+#define TASK_CONFIG_DEFAULT					\
+	((Task_Config)						\
+	{							\
+		.task_count_max   = TASK_COUNT_MAX,		\
+		.stack_size       = TASK_STACK_SIZE,		\
+		.stack_size_min   = TASK_STACK_SIZE_MIN,	\
+		.stack_size_max   = TASK_STACK_SIZE_MAX,	\
+		.stack_pool_count = TASK_STACK_POOL_COUNT,	\
+		.arena            = TASK_ARENA,			\
+		.slice_ns         = TASK_SLICE_NS,		\
+		.alloc_chunk_size = TASK_ALLOC_CHUNK_SIZE,	\
+		.alloc_pool_count = TASK_ALLOC_POOL_COUNT,	\
+	})
+
 /******************************************************************************
  * Handling of task data-structures.                                          *
  ******************************************************************************/
@@ -57,9 +211,53 @@ PACKED Task;
 Task *
 task_raw_create (void (*start)(void));
 
+// Stack sizes are rounded up to a multiple of 16 bytes.
+Task *
+task_raw_create_sized (void (*start)(void), usize stack_size);
+
+/* Creates a task with no stack of its own. Whenever the scheduler picks it,
+ * `resume (arg)` is called inline on the stack of whichever task was running,
+ * and its return value says what becomes of the task. Meant for stackless
+ * coroutines, so resume functions should return quickly and mustn't yield,
+ * park or terminate themselves.
+ */
+Task *
+task_raw_create_stackless (Task_Resume (*resume)(void *), void *arg);
+
 void
 task_raw_destroy (Task *t);
 
+// Sets aside `size` bytes at the top of a task's stack before it first runs,
+// aligned to `align` (a power of two), for data it is started with. Returns
+// NULL if that would leave less than `stack_size_min` of stack.
+void *
+task_raw_stack_reserve (Task *t, usize size, usize align);
+
+/* Sets how much FPU/SIMD state `t` keeps while switched out (TASK_FPU_NONE for
+ * every new task). Tasks with none run with MXCSR and the x87 control word at
+ * their defaults (0x1F80 and 0x037F) as long as they leave them alone, and
+ * the others start off with them. Can be called on the running task. Returns
+ * false if the CPU or OS doesn't support XSAVE (for TASK_FPU_FULL), or if the
+ * XSAVE area can't be allocated. Stackless tasks share the state of whichever
+ * task they are resumed on.
+ */
+bool
+task_raw_set_fpu (Task *t, Task_FPU mode);
+
+/* Also wakes a stackless task that's about to return TASK_RESUME_PARK once
+ * `timeout_ns` has passed, or once `poll` reports any of `events` (or an
+ * error) on `fd`, whichever comes first. Either is left out if negative. A
+ * `task_wake` before then cancels the gate, and setting another replaces it.
+ * With nothing else to run, the scheduler sleeps until a gate opens instead of
+ * spinning; otherwise fds are polled every 100 us or so.
+ */
+void
+task_raw_gate (Task *t, i64 timeout_ns, int fd, short events);
+
+// Makes a task from `task_raw_create` runnable.
+void
+task_raw_enqueue (Task *t);
+
 /******************************************************************************
  * Tasking interface.                                                         *
  ******************************************************************************/
@@ -67,13 +265,173 @@ task_raw_destroy (Task *t);
 bool
 task_create (void (*start)(void));
 
-noreturn void
+bool
+task_create_arg (void (*start)(void *), void *arg);
+
+// Like `task_create`, with a stack of `stack_bytes` instead of the default.
+bool
+task_create_sized (void (*start)(void), usize stack_bytes);
+
+// Creates a task in the deadline class. Deadline tasks run ahead of all
+// others, earliest deadline first, as long as they have budget left. Each
+// period of `period_ns` is also the task's deadline, and it may use up to
+// `budget_ns` of CPU time per period -- once that runs out (as measured when
+// it yields), it isn't run again until the next period starts. The budget
+// must be non-zero and no longer than the period.
+bool
+task_create_deadline (void (*start)(void), u64 period_ns, u64 budget_ns);
+
+NORETURN void
 task_terminate (void);
 
 void
 task_yield (void);
 
+/* For calling on every iteration of a long-running loop: yields only once the
+ * running task has used up its time slice (`slice_ns`, timed with the TSC from
+ * its first check since it was switched in), and not even then if no other
+ * task is runnable.
+ */
+void
+task_maybe_yield (void);
+
+Task_ID
+task_current_id (void);
+
+// The running task. Safe to call from a signal handler.
+Task *
+task_current (void);
+
+// The calling thread's scheduler instance -- 0 for the first thread to call
+// `task_setup`, and counting up from there.
+u32
+task_instance (void);
+
+// Number of switches between tasks an instance has made so far, counting each
+// run of a stackless task. Safe to call from any thread.
+u64
+task_switches (u32 instance);
+
+// Number of times an instance's tasks have yielded so far, including yields
+// that found nothing else to run, and slices `task_maybe_yield` renewed for
+// the same reason. Safe to call from any thread.
+u64
+task_yields (u32 instance);
+
+// Tells if an instance is asleep, waiting on other threads for something to
+// run. Safe to call from any thread.
+bool
+task_sleeping (u32 instance);
+
+// Takes the running task off the queue until `task_wake` is called for it.
+// When nothing else is runnable, this blocks until another thread injects
+// work.
+void
+task_park (void);
+
+bool
+task_wake (Task_ID tid);
+
+// Installs a function to be called whenever a task terminates, and before the
+// scheduler sleeps for lack of runnable tasks, for flushing anything tasks
+// have buffered (see `task_log.h`). NULL removes it.
+void
+task_set_flush_hook (void (*hook)(void));
+
+/* Starts tasking with the calling thread as the first task. A NULL `config`
+ * uses `TASK_CONFIG_DEFAULT`.
+ *
+ * Every thread that calls this gets a scheduler instance of its own, with its
+ * own tasks, queue and stacks; tasks never move between instances, and reach
+ * other instances only through the cross-thread interface below.
+ */
+bool
+task_setup (const Task_Config *config);
+
+/* Sets up one instance per CPU the calling thread may run on, each on a thread
+ * pinned to its CPU, so that its task table, queue and stacks are all first
+ * touched there -- and the arena, if any, is bound with `mbind` -- and come
+ * from that CPU's NUMA node. The calling thread takes the first CPU and
+ * carries on as that instance's first task, while on every other one,
+ * `start (arg)` runs as the first task.
+ *
+ * Instances are numbered from the caller's `task_instance` up, one per CPU in
+ * order. Those other than the caller's wait for work from `task_create_on`
+ * whenever they run out of tasks, and the process ends when the caller's
+ * instance does. Returns the number of instances that could be set up, or 0
+ * (having started none) if the caller's couldn't.
+ */
+u32
+task_setup_per_core (const Task_Config *config,
+		     void (*start)(void *), void *arg);
+
+/******************************************************************************
+ * Task allocation.                                                           *
+ ******************************************************************************/
+
+/* Memory from `task_alloc` belongs to the running task, and is only freed --
+ * all at once -- when that task is destroyed, so there is no `task_free`.
+ * Allocations are bumped out of chunks chained off the task, and the task's
+ * `alloc_used` and `alloc_held` count what it has asked for and what that
+ * takes up.
+ */
+
+// Aligned to 16 bytes. Returns NULL when out of memory.
+void *
+task_alloc (usize size);
+
+// Aligned to `align`, which must be a power of two.
+void *
+task_alloc_aligned (usize size, usize align);
+
+/******************************************************************************
+ * Fork-join.                                                                 *
+ ******************************************************************************/
+
+/* Runs `body` over [begin, end), split in halves down to chunks of at most
+ * `grain` items. Each split hands the upper half to a new task and carries on
+ * with the lower half inline; once its own chunk is done the caller parks
+ * until every task it spawned has finished. Upper halves that can't get a
+ * task run inline instead, still in chunks of at most `grain` items.
+ */
+void
+task_parallel_for (usize begin, usize end, usize grain,
+		   void (*body)(usize begin, usize end, void *ctx),
+		   void *ctx);
+
+/******************************************************************************
+ * Cross-thread interface.                                                    *
+ ******************************************************************************/
+
+/* These may be called from any thread (or signal handler) once `task_setup`
+ * has returned. Requests are queued without locking and carried out by the
+ * target instance on its next `task_yield`; false is returned if its inbox is
+ * full, or if there is no such instance. Those without an instance argument
+ * go to instance 0.
+ *
+ * A create that finds the target's task table full isn't dropped: it stays in
+ * the inbox, holding its slot, until a task there ends. Requests queued behind
+ * it are still carried out.
+ */
+
+bool
+task_inject_create (void (*start)(void));
+
+bool
+task_inject_wake (Task_ID tid);
+
+bool
+task_inject_wake_on (u32 instance, Task_ID tid);
+
+// Like `task_create_arg`, but on any instance. Creates the task directly when
+// that is the calling thread's own, so isn't for signal handlers, and returns
+// false there if the task table is full. Other instances hold the create until
+// they have room, as above.
 bool
-task_setup (void);
+task_create_on (u32 instance, void (*start)(void *), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
 
 /* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,246 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C -- C++ front-end.                    *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#pragma once
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "task.h"
+
+/* `task::spawn` moves a callable (captures and all) straight onto the top of
+ * the new task's stack, and calls it from there when the task first loads --
+ * no `std::function`, and no heap allocation beyond the stack itself.
+ *
+ *   task::Handle h = task::spawn ([&, n] { work (n); });
+ *   h.join();
+ *
+ * A `Handle` joins on destruction unless detached. Joining parks the caller
+ * until the task is done, rather than spinning on `task_yield`.
+ */
+
+namespace task
+{
+
+class Handle;
+
+// Spawns a task running `fn`, with a stack of `stack_size` bytes (or the
+// default, if zero). On failure the returned handle isn't joinable.
+template <typename F>
+Handle
+spawn (F &&fn, usize stack_size = 0);
+
+namespace detail
+{
+	// Kept at the top of the task's own stack for as long as it runs.
+	struct Frame_Base
+	{
+		Handle *owner = nullptr;
+	};
+
+	template <typename F>
+	struct Frame : Frame_Base
+	{
+		F fn;
+
+		template <typename G>
+		explicit Frame (G &&g) : fn (std::forward<G> (g)) {}
+	};
+
+	template <typename F>
+	void trampoline (void *arg) noexcept;
+
+	// Destroys a task that never got to run, unless released.
+	struct Task_Guard
+	{
+		Task *t;
+
+		~Task_Guard () { if (t != nullptr) task_raw_destroy (t); }
+	};
+}
+
+/******************************************************************************
+ * Task handles.                                                              *
+ ******************************************************************************/
+
+class Handle
+{
+public:
+	Handle () noexcept = default;
+
+	Handle (Handle &&other) noexcept
+	{
+		take (other);
+	}
+
+	Handle &
+	operator= (Handle &&other) noexcept
+	{
+		if (this != &other)
+		{
+			join();
+			take (other);
+		}
+
+		return *this;
+	}
+
+	Handle (const Handle &) = delete;
+	Handle &operator= (const Handle &) = delete;
+
+	~Handle ()
+	{
+		join();
+	}
+
+	Task_ID
+	id () const noexcept
+	{
+		return tid;
+	}
+
+	// False once the task has finished, been detached, or failed to spawn.
+	bool
+	joinable () const noexcept
+	{
+		return frame != nullptr;
+	}
+
+	explicit
+	operator bool () const noexcept
+	{
+		return joinable();
+	}
+
+	void
+	join () noexcept
+	{
+		while (frame != nullptr)
+		{
+			waiter  = task_current_id();
+			waiting = true;
+			task_park();
+			waiting = false;
+		}
+	}
+
+	void
+	detach () noexcept
+	{
+		if (frame != nullptr)
+			frame -> owner = nullptr;
+
+		frame = nullptr;
+	}
+
+private:
+	template <typename F>
+	friend Handle spawn (F &&fn, usize stack_size);
+
+	template <typename F>
+	friend void detail::trampoline (void *arg) noexcept;
+
+	void
+	take (Handle &other) noexcept
+	{
+		frame   = std::exchange (other.frame, nullptr);
+		tid     = other.tid;
+		waiting = false;
+
+		if (frame != nullptr)
+			frame -> owner = this;
+	}
+
+	// Called from the task, once the callable has returned.
+	void
+	finish () noexcept
+	{
+		frame = nullptr;
+
+		if (waiting)
+			task_wake (waiter);
+	}
+
+	detail::Frame_Base *frame   = nullptr;
+	Task_ID             tid     = 0;
+	Task_ID             waiter  = 0;
+	bool                waiting = false;
+};
+
+/******************************************************************************
+ * Spawning.                                                                  *
+ ******************************************************************************/
+
+template <typename F>
+void
+detail::trampoline (void *arg) noexcept
+{
+	auto *frame = static_cast<Frame<F> *> (arg);
+
+	frame -> fn();
+
+	// The handle may have moved while the task ran.
+	Handle *owner = frame -> owner;
+
+	frame -> ~Frame();
+
+	if (owner != nullptr)
+		owner -> finish();
+}
+
+template <typename F>
+Handle
+spawn (F &&fn, usize stack_size)
+{
+	using Fn    = std::decay_t<F>;
+	using Frame = detail::Frame<Fn>;
+
+	static_assert (std::is_invocable_v<Fn &>,
+		       "task::spawn needs a callable taking no arguments");
+
+	auto start = reinterpret_cast<void (*)(void)> (&detail::trampoline<Fn>);
+
+	Task *t = stack_size != 0
+		? task_raw_create_sized (start, stack_size)
+		: task_raw_create (start);
+
+	if (t == nullptr)
+		return Handle();
+
+	detail::Task_Guard guard { t };
+
+	void *mem = task_raw_stack_reserve (t, sizeof (Frame), alignof (Frame));
+
+	if (mem == nullptr)
+		return Handle();
+
+	Frame *frame = ::new (mem) Frame (std::forward<F> (fn));
+
+	guard.t        = nullptr;
+	t -> start_arg = reinterpret_cast<u64> (frame);
+
+	Handle h;
+
+	h.frame = frame;
+	h.tid   = t -> id;
+	frame -> owner = &h;
+
+	task_raw_enqueue (t);
+
+	return h;
+}
+
+inline void
+yield () noexcept
+{
+	task_yield();
+}
+
+} // namespace task
+
+/* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,353 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C -- C++20 coroutines.                 *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include <poll.h>
+
+#include "task.h"
+
+/* A `task::co::Routine` is a stackless coroutine run as a task of its own. It
+ * sits on the same run queue as ordinary tasks, but has no stack: when the
+ * scheduler picks it, it's resumed inline on the stack of whichever task was
+ * running, up to its next `co_await`.
+ *
+ *   task::co::Routine producer (task::co::Channel<int> &ch)
+ *   {
+ *           for (int i = 0; i < 10; i++)
+ *                   co_await ch.send (i);
+ *   }
+ *
+ *   task::co::spawn (producer (ch));
+ *
+ * Awaiting is only possible from inside a `Routine`; stackful tasks use
+ * `task_yield` and `task_park` as before. Resumes borrow the running task's
+ * stack, so keep deep calls out of coroutine bodies if tasks are given small
+ * stacks.
+ *
+ * `sleep_for` and the fd waits park the coroutine behind a gate (see
+ * `task_raw_gate`), so with nothing else runnable the scheduler sleeps until
+ * one of them is due.
+ */
+
+namespace task::co
+{
+
+class Routine;
+
+// Hands `r` to the scheduler. Returns false if there was no room for a task,
+// in which case the coroutine is destroyed without having run.
+bool
+spawn (Routine &&r);
+
+namespace detail
+{
+	struct Promise;
+
+	using Handle = std::coroutine_handle<Promise>;
+}
+
+/******************************************************************************
+ * Coroutines.                                                                *
+ ******************************************************************************/
+
+class Routine
+{
+public:
+	using promise_type = detail::Promise;
+
+	Routine (Routine &&other) noexcept
+		: handle (std::exchange (other.handle, nullptr)) {}
+
+	Routine (const Routine &) = delete;
+	Routine &operator= (const Routine &) = delete;
+	Routine &operator= (Routine &&) = delete;
+
+	// Only owns the coroutine until it's spawned.
+	~Routine ()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+private:
+	friend struct detail::Promise;
+	friend bool spawn (Routine &&r);
+
+	explicit Routine (detail::Handle h) noexcept : handle (h) {}
+
+	detail::Handle handle;
+};
+
+struct detail::Promise
+{
+	Task       *task   = nullptr;
+	Task_ID     tid    = 0;
+	Task_Resume result = TASK_RESUME_YIELD; // Set by awaitables.
+
+	Routine
+	get_return_object () noexcept
+	{
+		return Routine (Handle::from_promise (*this));
+	}
+
+	// Nothing runs until the scheduler first picks the task.
+	std::suspend_always initial_suspend () noexcept { return {}; }
+	std::suspend_always final_suspend () noexcept { return {}; }
+
+	void return_void () noexcept {}
+
+	// Nowhere to propagate to.
+	void unhandled_exception () noexcept { std::terminate(); }
+};
+
+namespace detail
+{
+	inline Task_Resume
+	resume (void *addr)
+	{
+		Handle   h = Handle::from_address (addr);
+		Promise &p = h.promise();
+
+		p.result = TASK_RESUME_YIELD;
+		h.resume();
+
+		if (h.done())
+		{
+			h.destroy();
+			return TASK_RESUME_DONE;
+		}
+
+		return p.result;
+	}
+
+	// Base of awaitables that always suspend, leaving the promise to say
+	// how.
+	struct Suspend
+	{
+		bool await_ready () const noexcept { return false; }
+		void await_resume () const noexcept {}
+	};
+}
+
+inline bool
+spawn (Routine &&r)
+{
+	Task *t = task_raw_create_stackless (&detail::resume,
+					     r.handle.address());
+
+	if (t == nullptr)
+		return false;
+
+	r.handle.promise().task = t;
+	r.handle.promise().tid  = t -> id;
+	r.handle = nullptr;
+
+	task_raw_enqueue (t);
+
+	return true;
+}
+
+/******************************************************************************
+ * Awaitables.                                                                *
+ ******************************************************************************/
+
+// Lets everything else on the queue run once.
+struct yield : detail::Suspend
+{
+	void await_suspend (detail::Handle) const noexcept {}
+};
+
+// Resumes no earlier than `duration` from now.
+struct sleep_for : detail::Suspend
+{
+	std::chrono::nanoseconds duration;
+
+	template <typename Rep, typename Period>
+	explicit sleep_for (std::chrono::duration<Rep, Period> d)
+		: duration (std::chrono::ceil<std::chrono::nanoseconds> (d)) {}
+
+	void
+	await_suspend (detail::Handle h) const noexcept
+	{
+		detail::Promise &p = h.promise();
+
+		task_raw_gate (p.task, std::max<i64> (duration.count(), 0),
+			       -1, 0);
+		p.result = TASK_RESUME_PARK;
+	}
+};
+
+// Resumes once `poll` reports any of `events` (or an error) on `fd`.
+struct wait_fd : detail::Suspend
+{
+	int   fd;
+	short events;
+
+	wait_fd (int fd, short events) : fd (fd), events (events) {}
+
+	void
+	await_suspend (detail::Handle h) const noexcept
+	{
+		detail::Promise &p = h.promise();
+
+		task_raw_gate (p.task, -1, fd, events);
+		p.result = TASK_RESUME_PARK;
+	}
+};
+
+inline wait_fd readable (int fd) { return wait_fd (fd, POLLIN); }
+inline wait_fd writable (int fd) { return wait_fd (fd, POLLOUT); }
+
+/******************************************************************************
+ * Channels.                                                                  *
+ ******************************************************************************/
+
+/* A queue of up to `capacity` values between coroutines, where a capacity of
+ * zero hands each value straight from sender to receiver. Coroutines that
+ * can't go on are parked, and values are handed to them directly as they are
+ * woken, so a waiter never finds its value gone.
+ */
+template <typename T>
+class Channel
+{
+public:
+	explicit Channel (std::size_t capacity = 0) : capacity (capacity) {}
+
+	Channel (const Channel &) = delete;
+	Channel &operator= (const Channel &) = delete;
+
+	class Send
+	{
+	public:
+		bool
+		await_ready ()
+		{
+			if (!ch.receivers.empty())
+			{
+				Receive *r = ch.receivers.front();
+
+				ch.receivers.pop_front();
+				r -> slot.emplace (std::move (value));
+				task_wake (r -> tid);
+
+				return true;
+			}
+
+			if (ch.buffer.size() < ch.capacity)
+			{
+				ch.buffer.push_back (std::move (value));
+				return true;
+			}
+
+			return false;
+		}
+
+		void
+		await_suspend (detail::Handle h)
+		{
+			tid = h.promise().tid;
+			h.promise().result = TASK_RESUME_PARK;
+			ch.senders.push_back (this);
+		}
+
+		// The value has been taken by the time this is woken.
+		void await_resume () const noexcept {}
+
+	private:
+		friend class Channel;
+
+		Send (Channel &ch, T value) : ch (ch), value (std::move (value)) {}
+
+		Channel &ch;
+		T        value;
+		Task_ID  tid = 0;
+	};
+
+	class Receive
+	{
+	public:
+		bool
+		await_ready ()
+		{
+			if (!ch.buffer.empty())
+			{
+				slot.emplace (std::move (ch.buffer.front()));
+				ch.buffer.pop_front();
+
+				// Room for a waiting sender's value.
+				if (!ch.senders.empty())
+				{
+					Send *s = ch.senders.front();
+
+					ch.senders.pop_front();
+					ch.buffer.push_back (std::move (s -> value));
+					task_wake (s -> tid);
+				}
+
+				return true;
+			}
+
+			if (!ch.senders.empty())
+			{
+				Send *s = ch.senders.front();
+
+				ch.senders.pop_front();
+				slot.emplace (std::move (s -> value));
+				task_wake (s -> tid);
+
+				return true;
+			}
+
+			return false;
+		}
+
+		void
+		await_suspend (detail::Handle h)
+		{
+			tid = h.promise().tid;
+			h.promise().result = TASK_RESUME_PARK;
+			ch.receivers.push_back (this);
+		}
+
+		T
+		await_resume ()
+		{
+			return std::move (*slot);
+		}
+
+	private:
+		friend class Channel;
+
+		explicit Receive (Channel &ch) : ch (ch) {}
+
+		Channel          &ch;
+		std::optional<T>  slot;
+		Task_ID           tid = 0;
+	};
+
+	Send    send (T value) { return Send (*this, std::move (value)); }
+	Receive receive ()     { return Receive (*this); }
+
+private:
+	std::size_t           capacity;
+	std::deque<T>         buffer;
+	std::deque<Send *>    senders;   // Parked, oldest first.
+	std::deque<Receive *> receivers;
+};
+
+} // namespace task::co
+
+/* ----------------------------------- EOF ---------------------------------- */
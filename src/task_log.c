@@ -0,0 +1,310 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#define _GNU_SOURCE
+
+#include "task_log.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/******************************************************************************
+ * Task buffers.                                                              *
+ ******************************************************************************/
+
+typedef struct
+{
+	u64  seq[TASK_LOG_LINES]; // Global sequence number of each line.
+	u32  end[TASK_LOG_LINES]; // Offset just past each line's text.
+	u32  lines;
+	char text[TASK_LOG_BUFFER_SIZE];
+}
+Task_Log_Buffer;
+
+// Where a buffered line sits, by its place in the sequence.
+typedef struct
+{
+	Task_Log_Buffer *b;
+	u32              line;
+}
+Task_Log_Line;
+
+// TIDs are only unique within a scheduler instance, so each instance (that
+// is, each thread) keeps a log of its own.
+#define TASK_LOG_LOCAL __thread
+
+static TASK_LOG_LOCAL int task_log_fd = -1;
+
+// Set once the exit flush is registered, by whichever instance got there
+// first.
+static bool task_log_at_exit = false;
+
+// Buffers by TID, allocated on first use and left to whichever task has the
+// TID next (they're always flushed by then).
+static TASK_LOG_LOCAL Task_Log_Buffer **task_log_buffers      = NULL;
+static TASK_LOG_LOCAL u32               task_log_buffer_count = 0;
+
+// Buffers holding any lines, so a flush doesn't visit the rest.
+static TASK_LOG_LOCAL Task_Log_Buffer **task_log_dirty       = NULL;
+static TASK_LOG_LOCAL u32               task_log_dirty_count = 0;
+
+// Room for every buffered line.
+static TASK_LOG_LOCAL Task_Log_Line *task_log_order = NULL;
+
+static TASK_LOG_LOCAL u64 task_log_seq     = 0; // Given to the next line.
+static TASK_LOG_LOCAL u64 task_log_written = 0; // Of the first line unflushed.
+
+// Kept off the task stacks, which may be small.
+static TASK_LOG_LOCAL struct iovec task_log_iov[IOV_MAX];
+
+static bool
+task_log_grow (u32 count)
+{
+	Task_Log_Buffer **buffers = realloc (task_log_buffers,
+					     count * sizeof (*buffers));
+
+	if (buffers == NULL)
+		return false;
+
+	task_log_buffers = buffers;
+
+	Task_Log_Buffer **dirty = realloc (task_log_dirty,
+					   count * sizeof (*dirty));
+
+	if (dirty == NULL)
+		return false;
+
+	task_log_dirty = dirty;
+
+	Task_Log_Line *order = realloc (task_log_order, (usize) count
+					* TASK_LOG_LINES * sizeof (*order));
+
+	if (order == NULL)
+		return false;
+
+	task_log_order = order;
+
+	for (u32 i = task_log_buffer_count; i < count; i++)
+		task_log_buffers[i] = NULL;
+
+	task_log_buffer_count = count;
+
+	return true;
+}
+
+static Task_Log_Buffer *
+task_log_buffer (Task_ID tid)
+{
+	if (tid >= task_log_buffer_count
+	    && !task_log_grow (max ((u32) tid + 1, task_log_buffer_count * 2)))
+		return NULL;
+
+	Task_Log_Buffer *b = task_log_buffers[tid];
+
+	if (b == NULL)
+	{
+		b = malloc (sizeof (Task_Log_Buffer));
+
+		if (b == NULL)
+			return NULL;
+
+		b -> lines = 0;
+		task_log_buffers[tid] = b;
+	}
+
+	return b;
+}
+
+/******************************************************************************
+ * Flushing.                                                                  *
+ ******************************************************************************/
+
+// Writes all of `iov`, carrying on after partial writes. Errors have nowhere
+// to be reported, so the rest is dropped.
+static void
+task_log_writev (struct iovec *iov, int count)
+{
+	while (count > 0)
+	{
+		ssize_t n = writev (task_log_fd, iov, count);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return;
+		}
+
+		while (count > 0 && (usize) n >= iov -> iov_len)
+		{
+			n -= iov -> iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0)
+		{
+			iov -> iov_base  = (char *) iov -> iov_base + n;
+			iov -> iov_len  -= n;
+		}
+	}
+}
+
+void
+task_log_flush (void)
+{
+	u64 count = task_log_seq - task_log_written;
+
+	if (count == 0)
+		return;
+
+	// The sequence has no gaps, so each line's number is its place.
+	for (u32 d = 0; d < task_log_dirty_count; d++)
+	{
+		Task_Log_Buffer *b = task_log_dirty[d];
+
+		for (u32 line = 0; line < b -> lines; line++)
+		{
+			u64 place = b -> seq[line] - task_log_written;
+
+			task_log_order[place] = (Task_Log_Line) { b, line };
+		}
+	}
+
+	// Consecutive lines from the same task are contiguous, so each run of
+	// them goes out as one iovec.
+	int n = 0;
+	u64 i = 0;
+
+	while (i < count)
+	{
+		Task_Log_Buffer *b     = task_log_order[i].b;
+		u32              first = task_log_order[i].line;
+		u32              last  = first;
+
+		for (i++; i < count && task_log_order[i].b == b
+			     && task_log_order[i].line == last + 1; i++)
+			last++;
+
+		u32 start = first != 0 ? b -> end[first - 1] : 0;
+
+		if (n == IOV_MAX)
+		{
+			task_log_writev (task_log_iov, n);
+			n = 0;
+		}
+
+		task_log_iov[n++] = (struct iovec)
+		{
+			.iov_base = b -> text + start,
+			.iov_len  = b -> end[last] - start,
+		};
+	}
+
+	task_log_writev (task_log_iov, n);
+
+	for (u32 d = 0; d < task_log_dirty_count; d++)
+		task_log_dirty[d] -> lines = 0;
+
+	task_log_dirty_count = 0;
+	task_log_written     = task_log_seq;
+}
+
+/******************************************************************************
+ * Logging interface.                                                         *
+ ******************************************************************************/
+
+bool
+task_log_setup (int fd)
+{
+	if (task_log_buffer_count == 0 && !task_log_grow (TASK_COUNT_MAX))
+		return false;
+
+	if (!__atomic_exchange_n (&task_log_at_exit, true, __ATOMIC_RELAXED)
+	    && atexit (task_log_flush) != 0)
+	{
+		__atomic_store_n (&task_log_at_exit, false, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	task_log_fd = fd;
+	task_set_flush_hook (task_log_flush);
+
+	return true;
+}
+
+void
+task_log (const char *format, ...)
+{
+	// This instance's log was never set up.
+	if (task_log_fd == -1)
+		return;
+
+	Task_Log_Buffer *b = task_log_buffer (task_current_id());
+
+	if (b == NULL)
+		return;
+
+	if (b -> lines == TASK_LOG_LINES)
+		task_log_flush();
+
+	va_list args;
+	va_start (args, format);
+
+	u32     used = b -> lines != 0 ? b -> end[b -> lines - 1] : 0;
+	usize   room = TASK_LOG_BUFFER_SIZE - used;
+	va_list copy;
+
+	va_copy (copy, args);
+	int len = vsnprintf (b -> text + used, room, format, copy);
+	va_end (copy);
+
+	if (len >= 0 && (usize) len >= room)
+	{
+		task_log_flush();
+		used = 0;
+
+		if (len < TASK_LOG_BUFFER_SIZE)
+		{
+			vsnprintf (b -> text, TASK_LOG_BUFFER_SIZE, format, args);
+		}
+		else
+		{
+			// Too long to ever buffer, but with nothing left ahead
+			// of it, it can go straight out.
+			char *line = malloc ((usize) len + 1);
+
+			if (line != NULL)
+			{
+				vsnprintf (line, (usize) len + 1, format, args);
+				task_log_writev (&(struct iovec) { line, len }, 1);
+				free (line);
+			}
+
+			len = -1;
+		}
+	}
+
+	va_end (args);
+
+	if (len < 0)
+		return;
+
+	b -> seq[b -> lines] = task_log_seq++;
+	b -> end[b -> lines] = used + len;
+
+	if (b -> lines++ == 0)
+		task_log_dirty[task_log_dirty_count++] = b;
+}
+
+/* ----------------------------------- EOF ---------------------------------- */
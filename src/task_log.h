@@ -0,0 +1,58 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#pragma once
+
+#include "task.h"
+
+/******************************************************************************
+ * Configuration.                                                             *
+ ******************************************************************************/
+
+// Text each task can buffer before a flush is forced.
+#ifndef   TASK_LOG_BUFFER_SIZE
+#  define TASK_LOG_BUFFER_SIZE 4096
+#endif
+
+// Lines each task can buffer before a flush is forced.
+#ifndef   TASK_LOG_LINES
+#  define TASK_LOG_LINES 64
+#endif
+
+/******************************************************************************
+ * Task logging.                                                              *
+ ******************************************************************************/
+
+/* Each task formats its lines into a buffer of its own, with no stdio lock
+ * and no system call. Every line also takes the next number of a sequence. A
+ * flush puts all the buffered lines back into that order and writes them with
+ * `writev`, coalescing runs of lines from the same task.
+ *
+ * Flushes happen when a task's buffer fills, as tasks terminate, and before
+ * the scheduler sleeps with nothing runnable (through `task_set_flush_hook`),
+ * as well as at exit for the thread that exits.
+ *
+ * Each scheduler instance has a log of its own, set up on its own thread and
+ * only used from there, with its own sequence: lines keep their order within
+ * an instance, but instances logging to one fd interleave by flush. Lines
+ * logged on an instance that hasn't called `task_log_setup` are dropped.
+ */
+
+// Starts logging the calling instance to `fd`. Call after `task_setup`, on
+// each instance that logs.
+bool
+task_log_setup (int fd);
+
+// Buffers one `printf`-formatted line (or any text -- nothing is appended).
+void
+task_log (const char *format, ...) CC_ATTR (format (printf, 1, 2));
+
+// Writes out everything the calling instance has buffered so far.
+void
+task_log_flush (void);
+
+/* ----------------------------------- EOF ---------------------------------- */
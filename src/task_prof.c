@@ -0,0 +1,342 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#define _GNU_SOURCE
+
+#include "task_prof.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Only named by glibc from 2.41 on.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/******************************************************************************
+ * Sample buffer.                                                             *
+ ******************************************************************************/
+
+typedef struct
+{
+	Task_ID id;
+	u32     depth;
+	u64     start_addr;
+	u64     pc[TASK_PROF_DEPTH]; // Leaf first.
+}
+Task_Sample;
+
+static Task_Sample *task_prof_samples  = NULL;
+static u32          task_prof_capacity = 0;
+static u32          task_prof_count    = 0; // Bumped past capacity on drops.
+
+// Stack bounds of the calling thread, which its instance's initial task runs
+// on without owning a stack of its own.
+static __thread u64 task_prof_main_lo = 0;
+static __thread u64 task_prof_main_hi = 0;
+
+static struct sigaction task_prof_old_action;
+static timer_t          task_prof_timer;
+
+// Samples carry TIDs, which only mean anything within one scheduler instance,
+// so only one instance is profiled at a time.
+static bool task_prof_running  = false;
+static u32  task_prof_instance = 0;
+
+/******************************************************************************
+ * Signal handling.                                                           *
+ ******************************************************************************/
+
+u32
+task_prof_walk (Task *t, void *ucontext, u64 *pc, u32 max)
+{
+	ucontext_t *uc = ucontext;
+
+	if (max == 0)
+		return 0;
+
+	pc[0] = (u64) uc -> uc_mcontext.gregs[REG_RIP];
+
+	if (t == NULL)
+		return 1;
+
+	u64 lo = task_prof_main_lo;
+	u64 hi = task_prof_main_hi;
+
+	if (t -> stack_start != 0)
+	{
+		hi = t -> stack_start;
+		lo = t -> stack_start + t -> stack_reserved - t -> stack_size;
+	}
+
+	u64 fp = (u64) uc -> uc_mcontext.gregs[REG_RBP];
+	u32 n  = 1;
+
+	// Each frame holds the caller's RBP, followed by the return address.
+	while (n < max && fp >= lo && fp + 16 <= hi && (fp & 7) == 0)
+	{
+		u64 *frame = (u64 *) fp;
+
+		if (frame[1] == 0)
+			break;
+
+		pc[n++] = frame[1];
+
+		// Frames only ever move up the stack.
+		if (frame[0] <= fp)
+			break;
+
+		fp = frame[0];
+	}
+
+	return n;
+}
+
+static void
+task_prof_handler (UNUSED int sig, UNUSED siginfo_t *info, void *ucontext)
+{
+	int saved_errno = errno;
+	u32 i = __atomic_fetch_add (&task_prof_count, 1, __ATOMIC_RELAXED);
+
+	if (i < task_prof_capacity)
+	{
+		Task        *t = task_current();
+		Task_Sample *s = &task_prof_samples[i];
+
+		s -> id         = t != NULL ? t -> id : 0;
+		s -> start_addr = t != NULL ? t -> start_addr : 0;
+		s -> depth      = task_prof_walk (t, ucontext, s -> pc,
+						  TASK_PROF_DEPTH);
+	}
+
+	errno = saved_errno;
+}
+
+/******************************************************************************
+ * Profiler interface.                                                        *
+ ******************************************************************************/
+
+bool
+task_prof_signal_stack (void)
+{
+	stack_t old;
+
+	if (sigaltstack (NULL, &old) != 0)
+		return false;
+
+	if (!(old.ss_flags & SS_DISABLE))
+		return true;
+
+	// Kept for as long as the thread lives.
+	stack_t ss =
+	{
+		.ss_sp    = malloc (TASK_PROF_SIGNAL_STACK_SIZE),
+		.ss_size  = TASK_PROF_SIGNAL_STACK_SIZE,
+		.ss_flags = 0,
+	};
+
+	if (ss.ss_sp == NULL)
+		return false;
+
+	if (sigaltstack (&ss, NULL) != 0)
+	{
+		free (ss.ss_sp);
+		return false;
+	}
+
+	return true;
+}
+
+void
+task_prof_find_main_stack (void)
+{
+	pthread_attr_t attr;
+	void          *addr;
+	usize          size;
+
+	if (pthread_getattr_np (pthread_self(), &attr) != 0)
+		return;
+
+	if (pthread_attr_getstack (&attr, &addr, &size) == 0)
+	{
+		task_prof_main_lo = (u64) addr;
+		task_prof_main_hi = (u64) addr + size;
+	}
+
+	pthread_attr_destroy (&attr);
+}
+
+// Sets up the sample buffer, the handler and the timer for `task_prof_start`.
+static bool
+task_prof_arm (u32 hz, u32 max_samples)
+{
+	free (task_prof_samples);
+	task_prof_samples = malloc ((usize) max_samples * sizeof (Task_Sample));
+
+	if (task_prof_samples == NULL)
+		return false;
+
+	task_prof_capacity = max_samples;
+	task_prof_count    = 0;
+
+	task_prof_find_main_stack();
+
+	if (!task_prof_signal_stack())
+		return false;
+
+	struct sigaction action = { 0 };
+
+	action.sa_sigaction = task_prof_handler;
+	action.sa_flags     = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+	sigemptyset (&action.sa_mask);
+
+	if (sigaction (SIGPROF, &action, &task_prof_old_action) != 0)
+		return false;
+
+	// Unlike ITIMER_PROF, which samples whichever thread of the process
+	// happens to be running, this only ever signals the calling thread.
+	struct sigevent event = { 0 };
+
+	event.sigev_notify           = SIGEV_THREAD_ID;
+	event.sigev_signo            = SIGPROF;
+	event.sigev_notify_thread_id = gettid();
+
+	if (timer_create (CLOCK_THREAD_CPUTIME_ID, &event,
+			  &task_prof_timer) != 0)
+	{
+		sigaction (SIGPROF, &task_prof_old_action, NULL);
+		return false;
+	}
+
+	struct itimerspec timer  = { 0 };
+	u64               period = 1000000000 / hz;
+
+	timer.it_interval.tv_sec  = period / 1000000000;
+	timer.it_interval.tv_nsec = period % 1000000000;
+	timer.it_value            = timer.it_interval;
+
+	if (timer_settime (task_prof_timer, 0, &timer, NULL) != 0)
+	{
+		timer_delete (task_prof_timer);
+		sigaction (SIGPROF, &task_prof_old_action, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+task_prof_start (u32 hz, u32 max_samples)
+{
+	if (hz == 0 || hz > 1000000 || max_samples == 0)
+		return false;
+
+	if (__atomic_exchange_n (&task_prof_running, true, __ATOMIC_ACQUIRE))
+		return false;
+
+	if (!task_prof_arm (hz, max_samples))
+	{
+		__atomic_store_n (&task_prof_running, false, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	task_prof_instance = task_instance();
+
+	return true;
+}
+
+void
+task_prof_stop (void)
+{
+	if (!__atomic_load_n (&task_prof_running, __ATOMIC_ACQUIRE)
+	    || task_instance() != task_prof_instance)
+		return;
+
+	timer_delete (task_prof_timer);
+	sigaction (SIGPROF, &task_prof_old_action, NULL);
+
+	__atomic_store_n (&task_prof_running, false, __ATOMIC_RELEASE);
+}
+
+static int
+task_prof_compare (const void *a, const void *b)
+{
+	const Task_Sample *x = a;
+	const Task_Sample *y = b;
+
+	if (x -> id != y -> id)
+		return x -> id < y -> id ? -1 : 1;
+
+	if (x -> start_addr != y -> start_addr)
+		return x -> start_addr < y -> start_addr ? -1 : 1;
+
+	if (x -> depth != y -> depth)
+		return x -> depth < y -> depth ? -1 : 1;
+
+	for (u32 i = 0; i < x -> depth; i++)
+		if (x -> pc[i] != y -> pc[i])
+			return x -> pc[i] < y -> pc[i] ? -1 : 1;
+
+	return 0;
+}
+
+static void
+task_prof_write_stack (FILE *out, const Task_Sample *s, u64 count)
+{
+	if (s -> start_addr != 0)
+		fprintf (out, "task-%u@0x%llx", s -> id,
+			 (unsigned long long) s -> start_addr);
+	else
+		fprintf (out, "task-%u@initial", s -> id);
+
+	// Folded stacks go from the root down to the leaf.
+	for (u32 i = s -> depth; i > 0; i--)
+		fprintf (out, ";0x%llx", (unsigned long long) s -> pc[i - 1]);
+
+	fprintf (out, " %llu\n", (unsigned long long) count);
+}
+
+i64
+task_prof_write (const char *path)
+{
+	u32 total = __atomic_load_n (&task_prof_count, __ATOMIC_RELAXED);
+	u32 count = min (total, task_prof_capacity);
+
+	FILE *out = fopen (path, "w");
+
+	if (out == NULL)
+		return -1;
+
+	qsort (task_prof_samples, count, sizeof (Task_Sample),
+	       task_prof_compare);
+
+	for (u32 i = 0; i < count;)
+	{
+		u32 run = i + 1;
+
+		while (run < count
+		       && task_prof_compare (&task_prof_samples[i],
+					     &task_prof_samples[run]) == 0)
+			run++;
+
+		task_prof_write_stack (out, &task_prof_samples[i], run - i);
+		i = run;
+	}
+
+	if (fclose (out) != 0)
+		return -1;
+
+	return total - count;
+}
+
+/* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,83 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#pragma once
+
+#include "task.h"
+
+/******************************************************************************
+ * Configuration.                                                             *
+ ******************************************************************************/
+
+// Deepest call-stack recorded per sample, including the interrupted RIP.
+#ifndef   TASK_PROF_DEPTH
+#  define TASK_PROF_DEPTH 32
+#endif
+
+// Size of the alternate stack sampling signals are handled on.
+#ifndef   TASK_PROF_SIGNAL_STACK_SIZE
+#  define TASK_PROF_SIGNAL_STACK_SIZE 65536
+#endif
+
+/******************************************************************************
+ * Sampling profiler.                                                         *
+ ******************************************************************************/
+
+/* SIGPROF comes from a timer on the CPU time of the thread that called
+ * `task_prof_start`, so only that thread's scheduler instance is sampled. On
+ * each one, the interrupted RIP is recorded together with a walk of the
+ * frame-pointer chain (so build with `-fno-omit-frame-pointer`), tagged with
+ * the running task's ID and entry point. Samples go into a buffer allocated up
+ * front, and ones that don't fit are counted but dropped.
+ *
+ * `task_prof_write` aggregates them as folded stacks, one line per distinct
+ * stack, rooted at the task:
+ *
+ *   task-3@0x401a2b;0x401b10;0x401c44 117
+ *
+ * Addresses are left for `addr2line -f -e <binary>` to symbolize, since a
+ * static binary has nothing for `dladdr` to go on.
+ *
+ * TIDs are per instance, so one instance is profiled at a time:
+ * `task_prof_start` fails while another is being profiled, and
+ * `task_prof_stop` does nothing on any instance but the profiled one.
+ */
+
+bool
+task_prof_start (u32 hz, u32 max_samples);
+
+void
+task_prof_stop (void);
+
+// Call after `task_prof_stop`. Returns the number of samples dropped for lack
+// of space, or -1 on failure.
+i64
+task_prof_write (const char *path);
+
+/* Walks the frame-pointer chain of the task `t` interrupted with the signal
+ * context `ucontext`, storing up to `max` return addresses into `pc`, with the
+ * interrupted RIP first. Frames are only followed while they stay within the
+ * task's stack. Async-signal-safe; returns the number of addresses stored.
+ */
+u32
+task_prof_walk (Task *t, void *ucontext, u64 *pc, u32 max);
+
+// Gives the calling thread an alternate signal stack, unless it has one, for
+// handlers installed with SA_ONSTACK. Task stacks may be small, and the
+// scheduler briefly runs on a tiny stack of its own while destroying a task,
+// so sampling signals can't be handled wherever they land.
+bool
+task_prof_signal_stack (void);
+
+// Records the bounds of the calling thread's stack, which its instance's
+// initial task runs on, for `task_prof_walk` on that thread. Done by
+// `task_prof_start`; anything else walking an initial task has to call it from
+// that task's thread first.
+void
+task_prof_find_main_stack (void);
+
+/* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,232 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#define _GNU_SOURCE
+
+#include "task_watchdog.h"
+#include "task_prof.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/******************************************************************************
+ * Stack sampling.                                                            *
+ ******************************************************************************/
+
+// Filled in by the signal handler on the scheduler thread, and only read by
+// the watchdog once `sampled` is set.
+static Task_ID task_watchdog_id      = 0;
+static u64     task_watchdog_entry   = 0;
+static u32     task_watchdog_depth   = 0;
+static u64     task_watchdog_pc[TASK_PROF_DEPTH];
+static int     task_watchdog_sampled = 0;
+
+static struct sigaction task_watchdog_old_action;
+
+static void
+task_watchdog_handler (UNUSED int sig, UNUSED siginfo_t *info, void *ucontext)
+{
+	int   saved_errno = errno;
+	Task *t           = task_current();
+
+	task_watchdog_id    = t != NULL ? t -> id : 0;
+	task_watchdog_entry = t != NULL ? t -> start_addr : 0;
+	task_watchdog_depth = task_prof_walk (t, ucontext, task_watchdog_pc,
+					      TASK_PROF_DEPTH);
+
+	__atomic_store_n (&task_watchdog_sampled, 1, __ATOMIC_RELEASE);
+
+	errno = saved_errno;
+}
+
+/******************************************************************************
+ * Watchdog thread.                                                           *
+ ******************************************************************************/
+
+static pthread_t task_watchdog_thread;
+static pthread_t task_watchdog_target;   // Runs the tasks.
+static u32       task_watchdog_instance; // Its scheduler instance.
+static bool      task_watchdog_active   = false;
+static int       task_watchdog_stopping = 0;
+
+static u64 task_watchdog_threshold = 0;
+static int task_watchdog_fd        = -1;
+
+// Moves on whenever the instance switches tasks, or its task yields even with
+// nothing else to run.
+static u64
+task_watchdog_beats (void)
+{
+	return task_switches (task_watchdog_instance)
+		+ task_yields (task_watchdog_instance);
+}
+
+static u64
+task_watchdog_now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (u64) ts.tv_sec * 1000000000 + (u64) ts.tv_nsec;
+}
+
+static void
+task_watchdog_sleep (u64 ns)
+{
+	struct timespec ts =
+	{
+		.tv_sec  = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	nanosleep (&ts, NULL);
+}
+
+// Samples the stalled task's stack and writes the report, unless the stall
+// ends before the sample is taken.
+static void
+task_watchdog_report (u64 stalled_ns, u64 beats)
+{
+	__atomic_store_n (&task_watchdog_sampled, 0, __ATOMIC_RELAXED);
+
+	if (pthread_kill (task_watchdog_target, TASK_WATCHDOG_SIGNAL) != 0)
+		return;
+
+	for (int i = 0; i < 100; i++)
+	{
+		if (__atomic_load_n (&task_watchdog_sampled, __ATOMIC_ACQUIRE))
+			break;
+
+		task_watchdog_sleep (1000000);
+	}
+
+	if (!__atomic_load_n (&task_watchdog_sampled, __ATOMIC_ACQUIRE)
+	    || task_watchdog_beats() != beats)
+		return;
+
+	char buffer[128 + TASK_PROF_DEPTH * 24]; // Fits a full stack.
+	int  len;
+
+	if (task_watchdog_entry != 0)
+		len = snprintf (buffer, sizeof (buffer),
+				"task watchdog: task %u (entry 0x%llx) has run"
+				" %llu ms without yielding\n",
+				task_watchdog_id,
+				(unsigned long long) task_watchdog_entry,
+				(unsigned long long) (stalled_ns / 1000000));
+	else
+		len = snprintf (buffer, sizeof (buffer),
+				"task watchdog: task %u (initial) has run"
+				" %llu ms without yielding\n",
+				task_watchdog_id,
+				(unsigned long long) (stalled_ns / 1000000));
+
+	for (u32 i = 0; i < task_watchdog_depth; i++)
+		len += snprintf (buffer + len, sizeof (buffer) - len,
+				 "  0x%llx\n",
+				 (unsigned long long) task_watchdog_pc[i]);
+
+	// A failed write has nowhere to be reported.
+	UNUSED ssize_t written = write (task_watchdog_fd, buffer, len);
+}
+
+static void *
+task_watchdog_main (UNUSED void *arg)
+{
+	u64  interval = max (task_watchdog_threshold / 4, (u64) 100000);
+	u64  seen     = task_watchdog_beats();
+	u64  since    = task_watchdog_now_ns();
+	bool reported = false;
+
+	while (!__atomic_load_n (&task_watchdog_stopping, __ATOMIC_RELAXED))
+	{
+		task_watchdog_sleep (interval);
+
+		u64 beats = task_watchdog_beats();
+		u64 now   = task_watchdog_now_ns();
+
+		// Waiting for other threads isn't hogging anything.
+		if (beats != seen || task_sleeping (task_watchdog_instance))
+		{
+			seen     = beats;
+			since    = now;
+			reported = false;
+			continue;
+		}
+
+		if (!reported && now - since >= task_watchdog_threshold)
+		{
+			task_watchdog_report (now - since, beats);
+			reported = true;
+		}
+	}
+
+	return NULL;
+}
+
+/******************************************************************************
+ * Watchdog interface.                                                        *
+ ******************************************************************************/
+
+bool
+task_watchdog_start (u64 threshold_ns, int fd)
+{
+	if (task_watchdog_active || threshold_ns == 0)
+		return false;
+
+	task_prof_find_main_stack();
+
+	if (!task_prof_signal_stack())
+		return false;
+
+	task_watchdog_threshold = threshold_ns;
+	task_watchdog_fd        = fd;
+	task_watchdog_target    = pthread_self();
+	task_watchdog_instance  = task_instance();
+	task_watchdog_stopping  = 0;
+
+	struct sigaction action = { 0 };
+
+	action.sa_sigaction = task_watchdog_handler;
+	action.sa_flags     = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+	sigemptyset (&action.sa_mask);
+
+	if (sigaction (TASK_WATCHDOG_SIGNAL, &action,
+		       &task_watchdog_old_action) != 0)
+		return false;
+
+	if (pthread_create (&task_watchdog_thread, NULL,
+			    task_watchdog_main, NULL) != 0)
+	{
+		sigaction (TASK_WATCHDOG_SIGNAL, &task_watchdog_old_action, NULL);
+		return false;
+	}
+
+	task_watchdog_active = true;
+
+	return true;
+}
+
+void
+task_watchdog_stop (void)
+{
+	if (!task_watchdog_active)
+		return;
+
+	__atomic_store_n (&task_watchdog_stopping, 1, __ATOMIC_RELAXED);
+	pthread_join (task_watchdog_thread, NULL);
+
+	sigaction (TASK_WATCHDOG_SIGNAL, &task_watchdog_old_action, NULL);
+	task_watchdog_active = false;
+}
+
+/* ----------------------------------- EOF ---------------------------------- */
@@ -0,0 +1,46 @@
+/******************************************************************************
+ * Simple co-operative multitasking in C.                                     *
+ *                                                                            *
+ * Authors:                                                                   *
+ *   Maxwell Powlison (bobdavelisafrank@protonmail.com)                       *
+ *                                                                            *
+ ******************************************************************************/
+#pragma once
+
+#include "task.h"
+
+/******************************************************************************
+ * Configuration.                                                             *
+ ******************************************************************************/
+
+// Signal used to stop the scheduler thread for a stack sample. Ignored by
+// default, so a late one does no harm.
+#ifndef   TASK_WATCHDOG_SIGNAL
+#  define TASK_WATCHDOG_SIGNAL SIGURG
+#endif
+
+/******************************************************************************
+ * Starvation watchdog.                                                       *
+ ******************************************************************************/
+
+/* A thread of its own checks `task_switches` and `task_yields` a few times per
+ * threshold. Once a task has held the CPU past `threshold_ns` without either
+ * moving, the scheduler thread is signalled to sample the task's stack (see
+ * `task_prof_walk`), and a report with its ID, entry point and stack is
+ * written to `fd`:
+ *
+ *   task watchdog: task 3 (entry 0x401a2b) has run 52 ms without yielding
+ *     0x401b10
+ *     0x401c44
+ *
+ * Each stall is reported once. Call from the thread running the tasks, after
+ * `task_setup`.
+ */
+
+bool
+task_watchdog_start (u64 threshold_ns, int fd);
+
+void
+task_watchdog_stop (void);
+
+/* ----------------------------------- EOF ---------------------------------- */